@@ -43,6 +43,11 @@
  *     Produce voluminous debugging output.
  * -DNDEBUG
  *     Disable sanity checking and assert statements.
+ * -DUSE_POSIX
+ *     Use POSIX processes to evaluate in parallel, and for batches and the
+ *     server (not in the tiny version).
+ * -DMINISK_LIBRARY
+ *     Build a library with the API in mini-sk.h rather than the REPL.
  *
  * Supported compilers and suggested command lines:
  *
@@ -72,6 +77,15 @@
  *
  */
 
+#ifdef TINY_VERSION
+#undef USE_POSIX
+#endif
+
+#ifdef USE_POSIX
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE		/* for MAP_ANONYMOUS, with glibc */
+#endif
+
 #ifdef USE_MINILIB
 #include <minilib.h>
 #else
@@ -81,6 +95,29 @@
 #include <assert.h>
 #include <string.h>
 
+#if defined(USE_POSIX) || !defined(TINY_VERSION) && !defined(CPM) \
+    && !defined(__Z88DK)
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#endif
+#ifdef USE_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+#ifdef MINISK_LIBRARY
+#include "mini-sk.h"
+#endif
+
 #ifdef HI_TECH_C
 #define const
 #define signed
@@ -98,7 +135,7 @@ typedef unsigned char uint8_t;
 #define __z88dk_fastcall
 #endif
 
-#define ARRAY_SIZE(array) sizeof(array)/sizeof(*(array))
+#define ARRAY_SIZE(array) (sizeof(array)/sizeof(*(array)))
 
 /* Note, we can't use varargs macros in this vanilla C89-style code */
 #ifdef DEBUG
@@ -107,53 +144,6 @@ typedef unsigned char uint8_t;
 #define debug_printf(args)
 #endif
 
-#ifdef TINY_VERSION
-/*
- * No switchable I/O.
- */
-
-#define getch()    getchar()
-#define ungetch(c) ungetchar(c)
-
-#else
-/*
- * Switchable I/O.
- *
- * We can read either from stdin or from memory.
- */
-
-void* input_context;
-
-short fgetchar(void)
-{
-    return (short)getc(input_context);
-}
-
-short fungetchar(char c)
-{
-    return (short)ungetc(c, (FILE*) input_context);
-}
-
-short sgetchar(void)
-{
-    char c = *(*((char**)input_context))++;
-    if (c == '\0')
-	return -1;
-    else
-	return c;
-}
-
-short sungetchar(char c) 
-{
-    char* cp = --(*((char**)input_context));
-    assert(*cp == c);
-    return 1;
-}
-
-short(*getch)(void) = fgetchar;
-short(*ungetch)(char c) = fungetchar;
-#endif
-
 typedef unsigned short literal;
 
 /* An atom is a 16-bit value that is either a 15-bit integer (i.e., it holds a
@@ -173,6 +163,7 @@ typedef struct app_node* atom;
 #define NODE_ARG(n)      ((n)->arg)
 #define NODE_REFCOUNT(n) ((n)->refcount)
 #define INDEX_TO_ATOM(i) &apps[i]
+#define ATOM_TO_INDEX(a) ((a) - apps)
 #define LIT_TO_ATOM(l)   ((atom) (((unsigned short) l)+(unsigned short) &apps[MAX_APPS]))
 #define ATOM_TO_LIT(a)   ((unsigned short) (a) - (unsigned short) &apps[MAX_APPS])
 #define LIT_REQARGS(l)   ((unsigned char) ((l) >> 8))
@@ -193,6 +184,7 @@ typedef struct app_node* atom;
 #define NODE_ARG(n)      ((n)->arg)
 #define NODE_REFCOUNT(n) ((n)->refcount)
 #define INDEX_TO_ATOM(i) &apps[i]
+#define ATOM_TO_INDEX(a) ((a) - apps)
 #ifndef TINY_VERSION
 #define IS_LIT(x) (!(((unsigned short) x) & 0x8000))
 #else
@@ -216,6 +208,7 @@ typedef uint16_t atom;
 #define NODE_ARG(n)  apps[(n) & 0x7fff].arg
 #define NODE_REFCOUNT(n) apps[(n) & 0x7fff].refcount
 #define INDEX_TO_ATOM(i) ((i) | 0x8000)
+#define ATOM_TO_INDEX(a) ((a) & 0x7fff)
 #define LIT_TO_ATOM(l)   (l)
 #define ATOM_TO_LIT(a)   (a)
 #define LIT_REQARGS(l)   ((unsigned char) ((l) >> 8))
@@ -246,8 +239,74 @@ typedef uint16_t atom;
 #define LIT_eq  0x030d
 #define LIT_lt  0x030e
 #define LIT_G   0x010f
+#define LIT_fadd 0x0310
+#define LIT_fsub 0x0311
+#define LIT_fmul 0x0312
+#define LIT_fdiv 0x0313
+#define LIT_feq  0x0314
+#define LIT_flt  0x0315
+#define LIT_itof 0x0216
+#define LIT_ftoi 0x0217
+#define LIT_STR  0x0218  /* box tag, see below */
+#define LIT_slen 0x0219
+#define LIT_sslice 0x041a
+#define LIT_scat 0x031b
+#define LIT_ARR  0x021c  /* box tag, see below */
+#define LIT_afromlist 0x021d
+#define LIT_aindex 0x031e
+#define LIT_alen 0x021f
+#define LIT_aslice 0x0420
+#define LIT_aset 0x0421
+#define LIT_amodify 0x0422
+#define LIT_minsert 0x0423
+#define LIT_mlookup 0x0424
+#define LIT_mdelete 0x0325
+#define LIT_msize 0x0226
+#define LIT_vmap 0x0327
+#define LIT_NUM  0x0328  /* native numeral tag, see below */
+#define LIT_nsucc 0x0129
+#define LIT_npred 0x012a
+#define LIT_niszero 0x012b
+#define LIT_nplus 0x022c
+#define LIT_nsub 0x022d
+#define LIT_ntimes 0x022e
+#define LIT_neq 0x022f
+#define LIT_nfact 0x0130
+#define LIT_ntoi 0x0231
+#define LIT_iton 0x0232
+#define LIT_pair 0x0333
+#define LIT_case 0x0334
+#define LIT_seq  0x0235
+#define LIT_deepseq 0x0236
+#define LIT_while 0x0337
+#define LIT_madd 0x0438
+#define LIT_clamp 0x0439
+#define LIT_iflt 0x043a
+#define LIT_ifeq 0x043b
+#define LIT_rng  0x013c
+#define LIT_pcg  0x033d
+#define LIT_rands 0x033e
+#define LIT_randlist 0x013f
+#define LIT_par  0x0240
+#define LIT_SPARK 0x0141  /* box tag, see below */
+#define LIT_pmap 0x0242
+#define LIT_pfilter 0x0243
+#define LIT_pfold 0x0344
 #define LIT_END 0x0400
 
+/*
+ * Tags for boxed values (see below).  Most boxes can't be applied to
+ * anything, so their tags ask for more arguments than any real spine will
+ * ever provide.  Strings and arrays are the exception, as they act like
+ * lists, and so are sparks, which are reduced when they're needed.
+ */
+
+#define LIT_FLT 0x7ff0
+#define LIT_MAP 0x7ff1
+
+#define IS_BOX_TAG(l)   (LIT_REQARGS(l) == 0x7f || (l) == LIT_STR \
+			 || (l) == LIT_ARR || (l) == LIT_SPARK)
+
 struct repr {
     char key;
     literal value;
@@ -272,6 +331,71 @@ struct repr reps[] = {
     {'G', LIT_G}
 };
 
+#ifndef TINY_VERSION
+/*
+ * Combinators that have no single-character representation, entered (and
+ * printed) as $ followed by their name.
+ */
+
+struct named_repr {
+    const char* name;
+    literal value;
+};
+
+struct named_repr named_reps[] = {
+    {"fadd", LIT_fadd},
+    {"fsub", LIT_fsub},
+    {"fmul", LIT_fmul},
+    {"fdiv", LIT_fdiv},
+    {"feq",  LIT_feq},
+    {"flt",  LIT_flt},
+    {"itof", LIT_itof},
+    {"ftoi", LIT_ftoi},
+    {"slen", LIT_slen},
+    {"sslice", LIT_sslice},
+    {"scat", LIT_scat},
+    {"afromlist", LIT_afromlist},
+    {"aindex", LIT_aindex},
+    {"alen", LIT_alen},
+    {"aslice", LIT_aslice},
+    {"aset", LIT_aset},
+    {"amodify", LIT_amodify},
+    {"minsert", LIT_minsert},
+    {"mlookup", LIT_mlookup},
+    {"mdelete", LIT_mdelete},
+    {"msize", LIT_msize},
+    {"vmap", LIT_vmap},
+    {"succ", LIT_nsucc},
+    {"pred", LIT_npred},
+    {"iszero", LIT_niszero},
+    {"plus", LIT_nplus},
+    {"sub", LIT_nsub},
+    {"times", LIT_ntimes},
+    {"eq", LIT_neq},
+    {"fact", LIT_nfact},
+    {"ntoi", LIT_ntoi},
+    {"iton", LIT_iton},
+    {"cons", LIT_pair},
+    {"pair", LIT_pair},
+    {"case", LIT_case},
+    {"seq", LIT_seq},
+    {"deepseq", LIT_deepseq},
+    {"while", LIT_while},
+    {"madd", LIT_madd},
+    {"clamp", LIT_clamp},
+    {"iflt", LIT_iflt},
+    {"ifeq", LIT_ifeq},
+    {"rng", LIT_rng},
+    {"pcg", LIT_pcg},
+    {"rands", LIT_rands},
+    {"randlist", LIT_randlist},
+    {"par", LIT_par},
+    {"pmap", LIT_pmap},
+    {"pfilter", LIT_pfilter},
+    {"pfold", LIT_pfold}
+};
+#endif
+
 struct app_node {
     atom func;
     atom arg;
@@ -310,17 +434,269 @@ struct app_node {
 /* Must ensure this is the last variable in memory */
 extern char beyond_end;
 #define apps ((struct app_node*) (&beyond_end))
-#else
-static struct app_node apps[MAX_APPS+1];
 #endif
-atom app_freelist;
 
-static unsigned int reductions = 0;
+#ifndef MAX_STACK
+#define MAX_STACK 512
+#endif
 
 atom alloc_app(atom func, atom arg);
 char free_app_all(atom a) __z88dk_fastcall;
 atom copy_atom(atom a) __z88dk_fastcall;
 
+#ifndef TINY_VERSION
+/*
+ * Boxed values.
+ *
+ * Values that don't fit in a 15-bit literal, such as floating-point
+ * numbers, strings, arrays and maps, live in a separate table of boxes.
+ * In the graph, a boxed value is an app node (TAG n), where TAG is a
+ * literal saying what kind of box it is and n is the index of the box in
+ * the table.  Each box belongs to exactly one such node, so the node's
+ * refcount also decides when the box is freed.
+ *
+ * As every box has a node, there's no use in more boxes than app nodes,
+ * except on small machines, where the memory is better spent on nodes.
+ */
+
+#ifndef MAX_BOXES
+#if defined(CPM) || defined(__Z88DK)
+#define MAX_BOXES (MAX_APPS / 8)
+#else
+#define MAX_BOXES MAX_APPS
+#endif
+#endif
+
+/*
+ * The bytes of a string are kept in a buffer that can be shared by several
+ * string boxes, since taking a slice of a string doesn't copy it.
+ */
+struct str_buf {
+    uint16_t refcount;
+    char data[1];
+};
+
+/* The longest string, whose length still fits in a literal. */
+#define MAX_STR_LEN 0x7fff
+
+struct str_box {
+    struct str_buf* buf;
+    uint16_t start;
+    uint16_t len;
+};
+
+/*
+ * Arrays work the same way, but hold atoms, each of which owns a reference.
+ */
+struct arr_buf {
+    uint16_t refcount;
+    uint16_t len;
+    atom elems[1];
+};
+
+struct arr_box {
+    struct arr_buf* buf;
+    uint16_t start;
+    uint16_t len;
+};
+
+/*
+ * Maps from literals to atoms are hash array mapped tries, with path
+ * copying so that updates leave the old map intact.  As keys are only 15
+ * bits, we can use them as their own hash, five bits per level, starting
+ * with the low bits, and the tries are at most three levels deep.  Nodes
+ * are shared between maps, so they have their own refcounts.
+ */
+struct map_node;
+
+struct map_entry {
+    struct map_node* child;	/* or NULL if the entry is a key/value pair */
+    literal key;
+    atom value;
+};
+
+struct map_node {
+    uint16_t refcount;
+    uint8_t count;
+    unsigned long bitmap;
+    struct map_entry entries[1];
+};
+
+struct map_box {
+    struct map_node* root;
+    uint16_t size;
+};
+
+#ifdef USE_POSIX
+/*
+ * A spark is a thunk that a worker process may be evaluating (see $par).
+ */
+struct spark_box {
+    atom thunk;
+    pid_t pid;		/* or 0 if no worker has started on it */
+    int fd;
+    uint8_t share;
+    uint8_t speculative;
+};
+
+void free_spark(atom a) __z88dk_fastcall;
+#endif
+
+struct box {
+    union {
+	double flt;
+	struct str_box str;
+	struct arr_box arr;
+	struct map_box map;
+#ifdef USE_POSIX
+	struct spark_box spark;
+#endif
+	uint16_t next_free;
+    } u;
+    atom owner;		/* the box's node, or 0 if the box is free */
+};
+
+#endif
+
+/*
+ * Engine state.
+ *
+ * Everything an interpreter works on (its heap of app nodes and boxes,
+ * its reduction stack and its input) lives in a struct engine, so that a
+ * process can have more than one.  Rather than being passed to every
+ * function, which would cost the Z80 versions dearly, the engine in use is
+ * the one that `engine' points to, and the macros below reach into it, so
+ * switching engines is just a matter of changing the pointer.  A host that
+ * runs engines on several threads can define ENGINE_LOCAL as its
+ * thread-local storage class.  Under z88dk, in the tiny version, and on
+ * CP/M, where atoms are addresses in a fixed apps array, there's only the
+ * default engine, which costs nothing extra to reach.
+ *
+ * With USE_POSIX, the state of parallel evaluation belongs to the process,
+ * as workers are copies of the whole process.
+ */
+
+#if !defined(TINY_VERSION) && !defined(CPM) && !defined(__Z88DK)
+#define MULTIPLE_ENGINES
+#endif
+
+#ifdef MINISK_LIBRARY
+#ifndef MULTIPLE_ENGINES
+#error "MINISK_LIBRARY needs a build with multiple engines"
+#endif
+#endif
+
+#ifdef MULTIPLE_ENGINES
+union mem_header;
+#endif
+
+struct engine {
+#ifndef USE_MINILIB
+    struct app_node apps[MAX_APPS+1];
+    atom red_stack[MAX_STACK+1];
+    atom* rs_top_ptr;
+#endif
+    atom app_freelist;
+    uint16_t current_apps;
+    uint16_t max_apps;
+    unsigned int reductions;
+    literal other_lit;
+    uint8_t print_reduced;
+#ifndef TINY_VERSION
+    struct box boxes[MAX_BOXES];
+    uint16_t box_freelist;
+    double other_flt;
+    void* input_context;
+    short (*getch)(void);
+    short (*ungetch)(char c);
+    void* output_context;
+    void (*putch)(char c) __z88dk_fastcall;
+    int (*io_get)(void* io);
+    int (*io_put)(int c, void* io);
+    void* io_context;
+#endif
+#ifdef MULTIPLE_ENGINES
+    union mem_header* mem_blocks;
+    size_t mem_bytes;
+    size_t mem_limit;
+    uint16_t app_limit;
+    unsigned int reduction_limit;
+    unsigned int check_at;	/* when reduce next calls check_reductions */
+    unsigned long time_start;	/* in milliseconds (see millis) */
+    unsigned long time_limit;	/* or 0 for none */
+#ifdef USE_POSIX
+    void (*yield)(void);	/* every CHECK_GRAIN reductions, if set */
+#endif
+    jmp_buf* on_error;
+    const char* error;
+    atom* macros;
+#endif
+#ifdef MINISK_LIBRARY
+    unsigned int generation;
+#endif
+};
+
+static struct engine default_engine;
+
+#ifdef MULTIPLE_ENGINES
+#ifndef ENGINE_LOCAL
+#define ENGINE_LOCAL
+#endif
+ENGINE_LOCAL struct engine* engine = &default_engine;
+#define ENGINE (*engine)
+#else
+#define ENGINE default_engine
+#endif
+
+#ifndef USE_MINILIB
+#define apps		(ENGINE.apps)
+#define red_stack	(ENGINE.red_stack)
+#define rs_top_ptr	(ENGINE.rs_top_ptr)
+#endif
+#define app_freelist	(ENGINE.app_freelist)
+#define current_apps	(ENGINE.current_apps)
+#define max_apps	(ENGINE.max_apps)
+#define reductions	(ENGINE.reductions)
+#define other_lit	(ENGINE.other_lit)
+#define print_reduced	(ENGINE.print_reduced)
+#ifndef TINY_VERSION
+#define boxes		(ENGINE.boxes)
+#define box_freelist	(ENGINE.box_freelist)
+#define other_flt	(ENGINE.other_flt)
+#define input_context	(ENGINE.input_context)
+#define getch		(ENGINE.getch)
+#define ungetch		(ENGINE.ungetch)
+#define output_context	(ENGINE.output_context)
+#define putch		(ENGINE.putch)
+#endif
+
+/*
+ * Running out of space, or reaching a limit (or anything else that leaves
+ * the engine unable to go on) is fatal for the REPL.  Elsewhere, such as
+ * in the library, there's somewhere to unwind to, on_error, and whoever
+ * set it up has the engine reset (see reset_engine).
+ */
+void engine_error(const char* msg) __z88dk_fastcall
+{
+#ifdef MULTIPLE_ENGINES
+    if (ENGINE.on_error != NULL) {
+	ENGINE.error = msg;
+	longjmp(*ENGINE.on_error, 1);
+    }
+#endif
+    fprintf(stderr, "%s\n", msg);
+#ifdef USE_POSIX
+    /*
+     * This may be a worker, whose input streams are shared with its
+     * parent, and exit would flush them, moving the parent's position.
+     */
+    fflush(stdout);
+    _exit(2);
+#else
+    exit(2);
+#endif
+}
+
 void init_apps(void)
 {
     uint16_t i;
@@ -334,115 +710,956 @@ void init_apps(void)
     SANITY_CHECK
 }
 
-atom reduce(atom curr) __z88dk_fastcall;
+#ifdef TINY_VERSION
+/*
+ * No switchable I/O.
+ */
 
-uint8_t print_reduced = 0;
+#define getch()    getchar()
+#define ungetch(c) ungetchar(c)
+#define putch(c)   putchar(c)
+#define put_uint(n) printf("%u", n)
+#define io_getchar()  getchar()
+#define io_putchar(c) putchar(c)
 
-void print_lit(literal lit) __z88dk_fastcall
+#else
+/*
+ * Switchable I/O.
+ *
+ * We can read either from stdin or from memory, and print terms either to
+ * stdout or to memory.  What the G and P combinators read and write is up
+ * to the io_get and io_put functions, which a library host can replace.
+ */
+
+#define io_getchar()  (ENGINE.io_get(ENGINE.io_context))
+#define io_putchar(c) (ENGINE.io_put((c), ENGINE.io_context))
+
+short fgetchar(void)
 {
-    unsigned char i;
-    i = LIT_SUBTYPE(lit);
-    if (i < ((unsigned char) ARRAY_SIZE(reps))
-	&& LIT_REQARGS(reps[i].value) == LIT_REQARGS(lit)) {
-	putchar(reps[i].key);
-    } else {
-	if (lit >= 32 && lit < 127) {
-	    putchar('\'');
-	    putchar(i);
-	} else {
-	    printf("%u", lit);
-	}
-    }
+    return (short)getc(input_context);
 }
 
-void print_atom(atom a) __z88dk_fastcall
+short fungetchar(char c)
 {
-    if (IS_LIT(a)) {
-	print_lit(ATOM_TO_LIT(a));
-    } else {
-	assert(NODE_REFCOUNT(a) != 0x8888);
-	assert(NODE_REFCOUNT(a) != 0x9e37);
-        assert(NODE_REFCOUNT(a) > 0);
+    return (short)ungetc(c, (FILE*) input_context);
+}
 
-	putchar('(');
-	print_atom(NODE_FUNC(a));
-	putchar(' ');
-	if (print_reduced && IS_LIT(NODE_FUNC(a)) 
-	    && LIT_REQARGS(ATOM_TO_LIT(NODE_FUNC(a))) == 0) {
-	    NODE_ARG(a) = reduce(NODE_ARG(a));
-	}
-	print_atom(NODE_ARG(a));
-	putchar(')');
-    }
+short sgetchar(void)
+{
+    char c = **((char**)input_context);
+    if (c == '\0')
+	return -1;
+    ++*((char**)input_context);
+    return c;
 }
 
-void print_atom_reduced(atom a) __z88dk_fastcall
+short sungetchar(char c) 
 {
-    print_reduced = 1;
-    print_atom(a);
-    print_reduced = 0;
+    char* cp = --(*((char**)input_context));
+    assert(*cp == c);
+    return 1;
 }
 
-uint16_t current_apps = 0;
-uint16_t max_apps = 0;
+void fputch(char c) __z88dk_fastcall
+{
+    putc(c, (FILE*) output_context);
+}
 
-#define App alloc_app
+/* Output to memory works like snprintf, counting what didn't fit. */
+struct out_buf {
+    char* buf;
+    size_t size;
+    size_t len;
+};
 
-atom read_atom();
+void sputch(char c) __z88dk_fastcall
+{
+    struct out_buf* ob = output_context;
+    if (ob->len + 1 < ob->size)
+	ob->buf[ob->len] = c;
+    ++ob->len;
+}
 
-#ifndef TINY_VERSION
-atom string_to_atom(const char *cp) __z88dk_fastcall
+void put_str(const char* cp) __z88dk_fastcall
 {
-    atom a;
-    void* saved_context = input_context;
-    short(*saved_getch)(void) = getch;
-    short(*saved_ungetch)(char c) = ungetch;
-    /*  printf("input_context := %p, (was %p)\n", input_context, &cp); */
-    input_context = (void*) &cp;
-    getch = sgetchar;
-    ungetch = sungetchar;
-    a = read_atom();
-    input_context = saved_context;
-    getch = saved_getch;
-    ungetch = saved_ungetch;
-    return a;
+    while (*cp)
+	putch(*cp++);
 }
 
-const char* builtins[][2] = {
-    { "t", "K" },
-    { "f", "F" },
-    { "and", "@@CCF" },
-    { "or", "@JK" },
-    { "not", "@@C@JFK" },
-    { "pair", "@@BCJ" },
-    { "fst", "@JK" },
-    { "snd", "@JF" },
-    { "succ", "@SB" },
-    { "pred", "@@C@@BC@@B@BC@@C@@BC@@B@BB@@CB@@B@BJJKI" },
-    { "iszero", "@@C@J@KFK" },
-    { "plus", "@@BS@BB" },
-    { "sub", "@@C@@BB@@C@J@J@@BJ@SB@JF@@B@S@@C@J@@B@C@@BBS@@B@S@@BBB@@B@BCC@KF@@C@@BB@J@@C@JKI@@C@J@@BKJK" },
-    { "times", "B" },
-    { "div2", "@@BC@@C@@BC@@C@@BB@J@@B@SBC@@BKKI" },
-    { "cdiv", "@@C@@BB@@C@J@J@@BJ@SB@JF@@B@S@@C@J@J@@BJ@@BKJ@JK@@C@@BC@@BJ@@B@B@C@@BBS@@B@B@S@@BBB@@B@B@BC@@B@BC@@B@CB@@C@@BB@J@@C@JKI@@BKJ@KF" },
-    { "fdiv", "@@B@B$pred@@B$ceiling$div$succ" },
-    { "divrem2", "@@C@J@J@@C@@BS@@B@B$pair@@S@@BC@@BJ$succ I$not@@$pair#0$f" },
-    { "tobinle", "@Y@@B@C$divrem2@@B@B@C$cons@S@@C$iszero$nil" },
-    { "tobinbe", "@@B$rev$tobinle" },
-    { "eq", "@@C@@BC@@C@@BC@@C@@BB@J@@C@J@@@SII@@BK@@BJ@@SIII@@C@J@@BKJKK@KF" },
-    { "lesseq", "@@B@B$iszero$sub" },
-    { "less", "@@B@B$not@@B@B$iszero@C$sub" },
-    { "greatereq", "@C$lesseq" },
-    { "greater", "@C$less" },
-    { "cons", "$pair" },
-    { "nil", "@KK" },
-    { "hd", "$fst" },
-    { "tl", "$snd" },
-    /*  { "case", "@@S@@BC@@B@BB@J@K@KFI" }, */
-    { "case", "@@C@@BC@@B@BC@@BC@@CB@@B@B@BK@B@BKI" },
-    { "take", "@@C@@BC@@C@@BC@@C@@BB@J@@SI@@C@@BC@@B@BC@C@@BC@@BJ@@B@B@BK@@B@B@BK@@B@BC@@B@BJ@@C@@BBB@@BCJI@C@JIK@KK" },
-    { "drop", "@J$tl" },
-    { "nth", "@@B@B$hd$drop" },
+void put_uint(unsigned int n) __z88dk_fastcall
+{
+    if (n >= 10)
+	put_uint(n / 10);
+    putch('0' + n % 10);
+}
+
+int std_get(void* io)
+{
+    (void) io;
+    return getchar();
+}
+
+int std_put(int c, void* io)
+{
+    (void) io;
+    return putchar(c);
+}
+
+/*
+ * Box tags are just literals, so anyone can write (TAG n); it's only a box
+ * if it's the node that box n belongs to.
+ */
+#define BOX_OF(a)       boxes[ATOM_TO_LIT(NODE_ARG(a))]
+#define OWNS_BOX(a)     (IS_LIT(NODE_ARG(a)) \
+			 && ATOM_TO_LIT(NODE_ARG(a)) < MAX_BOXES \
+			 && BOX_OF(a).owner == (a))
+#define IS_BOX(a)       (IS_LIT(NODE_FUNC(a)) \
+			 && IS_BOX_TAG(ATOM_TO_LIT(NODE_FUNC(a))) && OWNS_BOX(a))
+#define IS_BOXED(a,tag) (!IS_LIT(a) && NODE_FUNC(a) == LIT_TO_ATOM(tag) \
+			 && OWNS_BOX(a))
+
+void init_boxes(void)
+{
+    uint16_t i;
+    box_freelist = 0;
+    for (i = 0; i < MAX_BOXES; ++i) {
+	boxes[i].u.next_free = i+1;
+	boxes[i].owner = 0;
+    }
+}
+
+atom alloc_box(literal tag) __z88dk_fastcall
+{
+    uint16_t i = box_freelist;
+    if (i == MAX_BOXES)
+	engine_error("out of box space");
+    box_freelist = boxes[i].u.next_free;
+    return boxes[i].owner = alloc_app(LIT_TO_ATOM(tag), LIT_TO_ATOM(i));
+}
+
+#ifdef MULTIPLE_ENGINES
+/*
+ * An engine keeps a list of the memory it has allocated, so that it can
+ * all be freed when the engine is reset or deleted, even if an error left
+ * some of it unaccounted for, and so that it can be limited.
+ */
+union mem_header {
+    struct {
+	union mem_header* prev;
+	union mem_header* next;
+	size_t size;
+    } link;
+    double align;
+};
+
+void link_mem(union mem_header* h) __z88dk_fastcall
+{
+    h->link.prev = NULL;
+    h->link.next = ENGINE.mem_blocks;
+    if (h->link.next != NULL)
+	h->link.next->link.prev = h;
+    ENGINE.mem_blocks = h;
+}
+
+void unlink_mem(union mem_header* h) __z88dk_fastcall
+{
+    if (h->link.prev != NULL)
+	h->link.prev->link.next = h->link.next;
+    else
+	ENGINE.mem_blocks = h->link.next;
+    if (h->link.next != NULL)
+	h->link.next->link.prev = h->link.prev;
+}
+
+void* alloc_mem(size_t size) __z88dk_fastcall
+{
+    union mem_header* h;
+    if (size > ENGINE.mem_limit - ENGINE.mem_bytes)
+	engine_error("memory limit reached");
+    h = malloc(sizeof(union mem_header) + size);
+    if (h == NULL)
+	engine_error("out of memory");
+    h->link.size = size;
+    ENGINE.mem_bytes += size;
+    link_mem(h);
+    return h + 1;
+}
+
+void* realloc_mem(void* mem, size_t size)
+{
+    union mem_header* h;
+    union mem_header* moved;
+    if (mem == NULL)
+	return alloc_mem(size);
+    h = (union mem_header*) mem - 1;
+    if (size > h->link.size
+	&& size - h->link.size > ENGINE.mem_limit - ENGINE.mem_bytes)
+	engine_error("memory limit reached");
+    unlink_mem(h);
+    moved = realloc(h, sizeof(union mem_header) + size);
+    if (moved == NULL) {
+	link_mem(h);
+	engine_error("out of memory");
+    }
+    ENGINE.mem_bytes += size - moved->link.size;
+    moved->link.size = size;
+    link_mem(moved);
+    return moved + 1;
+}
+
+void free_mem(void* mem) __z88dk_fastcall
+{
+    union mem_header* h;
+    if (mem == NULL)
+	return;
+    h = (union mem_header*) mem - 1;
+    ENGINE.mem_bytes -= h->link.size;
+    unlink_mem(h);
+    free(h);
+}
+
+void free_all_mem(void)
+{
+    while (ENGINE.mem_blocks != NULL) {
+	union mem_header* h = ENGINE.mem_blocks;
+	ENGINE.mem_blocks = h->link.next;
+	free(h);
+    }
+    ENGINE.mem_bytes = 0;
+}
+#else
+void* alloc_mem(size_t size) __z88dk_fastcall
+{
+    void* mem = malloc(size);
+    if (mem == NULL)
+	engine_error("out of memory");
+    return mem;
+}
+
+void* realloc_mem(void* mem, size_t size)
+{
+    mem = realloc(mem, size);
+    if (mem == NULL)
+	engine_error("out of memory");
+    return mem;
+}
+
+#define free_mem(mem) free(mem)
+#endif
+
+void free_map_node(struct map_node* n) __z88dk_fastcall;
+
+void free_box(atom a) __z88dk_fastcall
+{
+    uint16_t i = ATOM_TO_LIT(NODE_ARG(a));
+    struct box* b = &boxes[i];
+    switch (ATOM_TO_LIT(NODE_FUNC(a))) {
+    case LIT_STR:
+	if (--b->u.str.buf->refcount == 0)
+	    free_mem(b->u.str.buf);
+	break;
+    case LIT_ARR:
+	if (--b->u.arr.buf->refcount == 0) {
+	    struct arr_buf* buf = b->u.arr.buf;
+	    uint16_t j;
+	    for (j = 0; j < buf->len; ++j)
+		free_app_all(buf->elems[j]);
+	    free_mem(buf);
+	}
+	break;
+    case LIT_MAP:
+	free_map_node(b->u.map.root);
+	break;
+#ifdef USE_POSIX
+    case LIT_SPARK:
+	free_spark(a);
+	break;
+#endif
+    }
+    b->u.next_free = box_freelist;
+    b->owner = 0;
+    box_freelist = i;
+}
+
+atom flt_to_atom(double d)
+{
+    atom a = alloc_box(LIT_FLT);
+    BOX_OF(a).u.flt = d;
+    return a;
+}
+
+struct str_buf* alloc_str_buf(uint16_t len) __z88dk_fastcall
+{
+    struct str_buf* buf = alloc_mem(sizeof(struct str_buf) + len);
+    buf->refcount = 0;
+    return buf;
+}
+
+atom str_to_atom(struct str_buf* buf, uint16_t start, uint16_t len)
+{
+    atom a = alloc_box(LIT_STR);
+    struct str_box* sb = &BOX_OF(a).u.str;
+    sb->buf = buf;
+    sb->start = start;
+    sb->len = len;
+    ++buf->refcount;
+    return a;
+}
+
+atom empty_str(void)
+{
+    return str_to_atom(alloc_str_buf(0), 0, 0);
+}
+
+/*
+ * Array buffers have room for at least eight elements, so that one
+ * allocated with length zero can be filled in using arr_buf_append.
+ */
+struct arr_buf* alloc_arr_buf(uint16_t len) __z88dk_fastcall
+{
+    struct arr_buf* buf =
+	alloc_mem(sizeof(struct arr_buf) + ((len < 8 ? 8 : len)-1)*sizeof(atom));
+    buf->refcount = 0;
+    buf->len = len;
+    return buf;
+}
+
+/* Doubles the buffer's size whenever its length reaches a power of two. */
+struct arr_buf* arr_buf_append(struct arr_buf* buf, atom elem)
+{
+    uint16_t len = buf->len;
+    if (len >= 8 && (len & (len-1)) == 0) {
+	buf = realloc_mem(buf, sizeof(struct arr_buf) + (2*len-1)*sizeof(atom));
+    }
+    buf->elems[buf->len++] = elem;
+    return buf;
+}
+
+atom arr_to_atom(struct arr_buf* buf, uint16_t start, uint16_t len)
+{
+    atom a = alloc_box(LIT_ARR);
+    struct arr_box* ab = &BOX_OF(a).u.arr;
+    ab->buf = buf;
+    ab->start = start;
+    ab->len = len;
+    ++buf->refcount;
+    return a;
+}
+
+/* Anything that isn't an array acts like the empty array. */
+struct arr_box* atom_to_arr(atom a) __z88dk_fastcall
+{
+    static struct arr_box empty;
+    if (IS_BOXED(a, LIT_ARR))
+	return &BOX_OF(a).u.arr;
+    return &empty;
+}
+
+uint8_t popcount(unsigned long bits)
+{
+    uint8_t count = 0;
+    for (; bits; bits &= bits - 1)
+	++count;
+    return count;
+}
+
+struct map_node* alloc_map_node(uint8_t count, unsigned long bitmap)
+{
+    struct map_node* n = alloc_mem(sizeof(struct map_node)
+				   + (count-1)*sizeof(struct map_entry));
+    n->refcount = 1;
+    n->count = count;
+    n->bitmap = bitmap;
+    return n;
+}
+
+void free_map_node(struct map_node* n) __z88dk_fastcall
+{
+    uint8_t i;
+    if (n == NULL || --n->refcount)
+	return;
+    for (i = 0; i < n->count; ++i) {
+	if (n->entries[i].child)
+	    free_map_node(n->entries[i].child);
+	else
+	    free_app_all(n->entries[i].value);
+    }
+    free_mem(n);
+}
+
+void share_map_entry(struct map_entry* to, struct map_entry* from)
+{
+    *to = *from;
+    if (from->child)
+	++from->child->refcount;
+    else
+	copy_atom(from->value);
+}
+
+void set_map_pair(struct map_entry* e, literal key, atom value)
+{
+    e->child = NULL;
+    e->key = key;
+    e->value = value;
+}
+
+/*
+ * Copies a trie node, sharing its entries, except that the entry at idx is
+ * left for the caller to fill in, or a new one is inserted there if grow
+ * is positive, or the entry is removed if it is negative.
+ */
+struct map_node* copy_map_node(struct map_node* n, unsigned long bitmap,
+			       uint8_t idx, signed char grow)
+{
+    struct map_node* copy = alloc_map_node(n->count + grow, bitmap);
+    uint8_t i, j;
+    for (i = 0, j = 0; i < n->count; ++i, ++j) {
+	if (i == idx) {
+	    if (grow < 0) {
+		--j;
+		continue;
+	    }
+	    if (grow == 0)
+		continue;
+	    ++j;
+	}
+	share_map_entry(&copy->entries[j], &n->entries[i]);
+    }
+    return copy;
+}
+
+#define MAP_BIT(key,shift) (1UL << (((key) >> (shift)) & 31))
+#define MAP_IDX(n,bit)     popcount((n)->bitmap & ((bit) - 1))
+
+atom* map_lookup(struct map_node* n, literal key)
+{
+    uint8_t shift;
+    for (shift = 0; n != NULL; shift += 5) {
+	unsigned long bit = MAP_BIT(key, shift);
+	struct map_entry* e = &n->entries[MAP_IDX(n, bit)];
+	if (!(n->bitmap & bit))
+	    return NULL;
+	if (e->child == NULL)
+	    return e->key == key ? &e->value : NULL;
+	n = e->child;
+    }
+    return NULL;
+}
+
+/*
+ * Returns a new trie that is like the one rooted at n, but maps key to
+ * value (taking over our reference to it).  *added is set if the key
+ * wasn't there before.
+ */
+struct map_node* map_insert(struct map_node* n, literal key, atom value,
+			    uint8_t shift, char* added)
+{
+    unsigned long bit = MAP_BIT(key, shift);
+    uint8_t idx;
+    struct map_node* copy;
+    struct map_entry* e;
+    *added = 1;
+    if (n == NULL) {
+	copy = alloc_map_node(1, bit);
+	set_map_pair(&copy->entries[0], key, value);
+	return copy;
+    }
+    idx = MAP_IDX(n, bit);
+    if (!(n->bitmap & bit)) {
+	copy = copy_map_node(n, n->bitmap | bit, idx, 1);
+	set_map_pair(&copy->entries[idx], key, value);
+	return copy;
+    }
+    e = &n->entries[idx];
+    copy = copy_map_node(n, n->bitmap, idx, 0);
+    if (e->child) {
+	copy->entries[idx].child =
+	    map_insert(e->child, key, value, shift+5, added);
+    } else if (e->key == key) {
+	set_map_pair(&copy->entries[idx], key, value);
+	*added = 0;
+    } else {
+	/* Two keys that agree so far, so they go down a level */
+	struct map_node* pair =
+	    map_insert(NULL, e->key, copy_atom(e->value), shift+5, added);
+	copy->entries[idx].child =
+	    map_insert(pair, key, value, shift+5, added);
+	free_map_node(pair);
+    }
+    return copy;
+}
+
+/*
+ * Returns a new trie that is like the one rooted at n, but without key, or
+ * NULL if that leaves it empty.  *removed is set if the key was there;
+ * otherwise we just return n with an extra reference.
+ */
+struct map_node* map_delete(struct map_node* n, literal key, uint8_t shift,
+			    char* removed)
+{
+    unsigned long bit = MAP_BIT(key, shift);
+    uint8_t idx = MAP_IDX(n, bit);
+    struct map_entry* e = &n->entries[idx];
+    struct map_node* copy;
+    *removed = 0;
+    if (!(n->bitmap & bit) || (e->child == NULL && e->key != key)) {
+	++n->refcount;
+	return n;
+    }
+    if (e->child) {
+	struct map_node* child = map_delete(e->child, key, shift+5, removed);
+	if (!*removed) {
+	    free_map_node(child);
+	    ++n->refcount;
+	    return n;
+	}
+	if (child != NULL) {
+	    copy = copy_map_node(n, n->bitmap, idx, 0);
+	    if (child->count == 1 && child->entries[0].child == NULL) {
+		/* A lone pair moves up to take the place of its node */
+		share_map_entry(&copy->entries[idx], &child->entries[0]);
+		free_map_node(child);
+	    } else {
+		copy->entries[idx].child = child;
+	    }
+	    return copy;
+	}
+    }
+    *removed = 1;
+    if (n->count == 1)
+	return NULL;
+    return copy_map_node(n, n->bitmap & ~bit, idx, -1);
+}
+
+atom map_to_atom(struct map_node* root, uint16_t size)
+{
+    atom a = alloc_box(LIT_MAP);
+    BOX_OF(a).u.map.root = root;
+    BOX_OF(a).u.map.size = size;
+    return a;
+}
+
+/* Anything that isn't a map acts like the empty map. */
+struct map_box* atom_to_map(atom a) __z88dk_fastcall
+{
+    static struct map_box empty;
+    if (IS_BOXED(a, LIT_MAP))
+	return &BOX_OF(a).u.map;
+    return &empty;
+}
+
+/* Anything that isn't a string acts like the empty string. */
+struct str_box* atom_to_str(atom a) __z88dk_fastcall
+{
+    static struct str_box empty;
+    if (IS_BOXED(a, LIT_STR))
+	return &BOX_OF(a).u.str;
+    return &empty;
+}
+
+/* Literals are promoted, anything else that isn't a float is zero. */
+double atom_to_flt(atom a) __z88dk_fastcall
+{
+    if (IS_LIT(a))
+	return (double) ATOM_TO_LIT(a);
+    if (IS_BOXED(a, LIT_FLT))
+	return BOX_OF(a).u.flt;
+    return 0.0;
+}
+
+/*
+ * Native numerals are app nodes (NUM n), where n is a literal.  Applied
+ * to f and x, they apply f to x n times, just like the Church numeral for
+ * n, but numeric macros such as $plus can work on them directly.  NUM is
+ * also the number 808, so (808 x) can be typed in with x not a literal;
+ * that isn't a numeral, and counts as zero when applied.
+ */
+
+#define IS_NUM(a)       (!IS_LIT(a) && NODE_FUNC(a) == LIT_TO_ATOM(LIT_NUM) \
+			 && IS_LIT(NODE_ARG(a)))
+#define NUM_VALUE(a)    ATOM_TO_LIT(NODE_ARG(a))
+
+atom num_to_atom(literal n) __z88dk_fastcall
+{
+    return alloc_app(LIT_TO_ATOM(LIT_NUM), LIT_TO_ATOM(n));
+}
+#endif
+
+#ifdef MULTIPLE_ENGINES
+/*
+ * Every CHECK_GRAIN reductions, if need be, reduce stops to check the
+ * time, and for interrupts, and in a session, to yield.
+ */
+#ifndef CHECK_GRAIN
+#define CHECK_GRAIN 10000
+#endif
+
+volatile sig_atomic_t interrupted = 0;
+uint8_t catching_interrupts = 0;
+
+void on_interrupt(int sig)
+{
+    interrupted = 1;
+    signal(sig, on_interrupt);
+}
+
+/* While reducing, SIGINT just abandons the term (see check_reductions). */
+void catch_interrupts(uint8_t catching) __z88dk_fastcall
+{
+    interrupted = 0;
+    catching_interrupts = catching;
+    signal(SIGINT, catching ? on_interrupt : SIG_DFL);
+}
+
+/* Milliseconds from some fixed time (CPU time, without USE_POSIX). */
+unsigned long millis(void)
+{
+#ifdef USE_POSIX
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+#else
+    return (unsigned long) ((double) clock() * 1000 / CLOCKS_PER_SEC);
+#endif
+}
+
+void update_check_at(void)
+{
+    ENGINE.check_at = ENGINE.reduction_limit;
+    if ((ENGINE.time_limit != 0 || catching_interrupts
+#ifdef USE_POSIX
+	 || ENGINE.yield != NULL
+#endif
+	    ) && ENGINE.reduction_limit - reductions > CHECK_GRAIN)
+	ENGINE.check_at = reductions + CHECK_GRAIN;
+}
+
+/*
+ * Called by reduce when reductions reach check_at, either because there
+ * are no more to be had, or because it's time to check on other things.
+ */
+void check_reductions(void)
+{
+    /* Without a limit, the count just wraps round. */
+    if (reductions >= ENGINE.reduction_limit
+	&& ENGINE.reduction_limit != (unsigned int) -1)
+	engine_error("reduction limit reached");
+    if (interrupted) {
+	interrupted = 0;
+	engine_error("interrupted");
+    }
+    if (ENGINE.time_limit != 0
+	&& millis() - ENGINE.time_start >= ENGINE.time_limit)
+	engine_error("time limit reached");
+#ifdef USE_POSIX
+    if (ENGINE.yield != NULL)
+	ENGINE.yield();
+#endif
+    update_check_at();
+}
+
+/*
+ * Limits what the engine can use from now on, beyond what it's using now,
+ * with 0 for no limit.  Reductions are counted from 0.
+ */
+void set_limits(unsigned int max_reductions, uint16_t max_nodes,
+		size_t max_bytes, unsigned long max_millis)
+{
+    ENGINE.reduction_limit = max_reductions != 0
+	? max_reductions : (unsigned int) -1;
+    ENGINE.app_limit = max_nodes != 0 && max_nodes < MAX_APPS - current_apps
+	? current_apps + max_nodes : MAX_APPS;
+    ENGINE.mem_limit = max_bytes != 0
+	&& max_bytes < (size_t) -1 - ENGINE.mem_bytes
+	? ENGINE.mem_bytes + max_bytes : (size_t) -1;
+    ENGINE.time_limit = max_millis;
+    if (max_millis != 0)
+	ENGINE.time_start = millis();
+    update_check_at();
+}
+
+void clear_limits(void)
+{
+    set_limits(0, 0, 0, 0);
+}
+#endif
+
+/*
+ * Sets up the engine in use, with an empty heap, reading from stdin and
+ * writing to stdout.
+ */
+void init_engine(void)
+{
+#ifndef USE_MINILIB
+    rs_top_ptr = &red_stack[MAX_STACK];
+#endif
+    current_apps = max_apps = 0;
+    reductions = 0;
+    print_reduced = 0;
+    init_apps();
+#ifndef TINY_VERSION
+    init_boxes();
+    input_context = (void*) stdin;
+    getch = fgetchar;
+    ungetch = fungetchar;
+    output_context = (void*) stdout;
+    putch = fputch;
+    ENGINE.io_get = std_get;
+    ENGINE.io_put = std_put;
+    ENGINE.io_context = NULL;
+#endif
+#ifdef MULTIPLE_ENGINES
+    ENGINE.mem_blocks = NULL;
+    ENGINE.mem_bytes = 0;
+    ENGINE.on_error = NULL;
+    ENGINE.macros = NULL;
+#ifdef USE_POSIX
+    ENGINE.yield = NULL;
+#endif
+    clear_limits();
+#endif
+}
+
+#ifdef MULTIPLE_ENGINES
+/* Makes a new engine, and starts using it (or returns NULL). */
+struct engine* new_engine(void)
+{
+    struct engine* e = malloc(sizeof(struct engine));
+    if (e == NULL)
+	return NULL;
+    engine = e;
+    init_engine();
+    return e;
+}
+
+/* Frees the engine, and whatever is still in its heap. */
+void free_engine(struct engine* e) __z88dk_fastcall
+{
+    struct engine* saved = engine;
+    engine = e;
+    free_all_mem();
+    engine = saved;
+    if (engine == e)
+	engine = &default_engine;
+    if (e != &default_engine)
+	free(e);
+}
+#endif
+
+atom reduce(atom curr) __z88dk_fastcall;
+
+void print_atom(atom a) __z88dk_fastcall;
+
+void print_lit(literal lit) __z88dk_fastcall
+{
+    unsigned char i;
+    i = LIT_SUBTYPE(lit);
+    if (i < ((unsigned char) ARRAY_SIZE(reps))
+	&& LIT_REQARGS(reps[i].value) == LIT_REQARGS(lit)) {
+	putch(reps[i].key);
+    } else {
+	if (lit >= 32 && lit < 127) {
+	    putch('\'');
+	    putch(i);
+	} else {
+#ifndef TINY_VERSION
+	    for (i = 0; i < (unsigned char) ARRAY_SIZE(named_reps); ++i) {
+		if (named_reps[i].value == lit) {
+		    putch('$');
+		    put_str(named_reps[i].name);
+		    return;
+		}
+	    }
+#endif
+	    put_uint(lit);
+	}
+    }
+}
+
+#ifndef TINY_VERSION
+/*
+ * Floats are printed so they read back as floats, i.e., always with a
+ * decimal point.
+ */
+void print_flt(double d)
+{
+    char digits[32];
+    if (d > -1e9 && d < 1e9 && d == (double) (long) d)
+	sprintf(digits, "%ld.0", (long) d);
+    else
+	sprintf(digits, "%.15g", d);
+    put_str(digits);
+}
+
+void print_str(struct str_box* sb) __z88dk_fastcall
+{
+    const char* cp = sb->buf->data + sb->start;
+    const char* end = cp + sb->len;
+    putch('"');
+    for (; cp != end; ++cp) {
+	switch (*cp) {
+	case '\n':
+	    put_str("\\n");
+	    break;
+	case '"':
+	case '\\':
+	    putch('\\');
+	    /* fall through */
+	default:
+	    putch(*cp);
+	}
+    }
+    putch('"');
+}
+
+void print_arr(struct arr_box* ab) __z88dk_fastcall
+{
+    atom* ep = ab->buf->elems + ab->start;
+    uint16_t i;
+    putch('[');
+    for (i = 0; i < ab->len; ++i) {
+	if (i > 0)
+	    putch(' ');
+	if (print_reduced)
+	    ep[i] = reduce(ep[i]);
+	print_atom(ep[i]);
+    }
+    putch(']');
+}
+
+void print_map_node(struct map_node* n, char* sep)
+{
+    uint8_t i;
+    for (i = 0; n != NULL && i < n->count; ++i) {
+	struct map_entry* e = &n->entries[i];
+	if (e->child) {
+	    print_map_node(e->child, sep);
+	    continue;
+	}
+	if (*sep)
+	    putch(*sep);
+	*sep = ' ';
+	print_lit(e->key);
+	putch(' ');
+	if (print_reduced)
+	    e->value = reduce(e->value);
+	print_atom(e->value);
+    }
+}
+
+void print_box(atom a) __z88dk_fastcall
+{
+    switch (ATOM_TO_LIT(NODE_FUNC(a))) {
+    case LIT_FLT:
+	print_flt(BOX_OF(a).u.flt);
+	break;
+    case LIT_STR:
+	print_str(&BOX_OF(a).u.str);
+	break;
+    case LIT_ARR:
+	print_arr(&BOX_OF(a).u.arr);
+	break;
+    case LIT_MAP: {
+	char sep = '\0';
+	putch('{');
+	print_map_node(BOX_OF(a).u.map.root, &sep);
+	putch('}');
+	break;
+    }
+#ifdef USE_POSIX
+    case LIT_SPARK:
+	print_atom(BOX_OF(a).u.spark.thunk);
+	break;
+#endif
+    }
+}
+#endif
+
+void print_atom(atom a) __z88dk_fastcall
+{
+    if (IS_LIT(a)) {
+	print_lit(ATOM_TO_LIT(a));
+    } else {
+	assert(NODE_REFCOUNT(a) != 0x8888);
+	assert(NODE_REFCOUNT(a) != 0x9e37);
+        assert(NODE_REFCOUNT(a) > 0);
+#ifndef TINY_VERSION
+	if (IS_BOX(a)) {
+	    print_box(a);
+	    return;
+	}
+	if (IS_NUM(a)) {
+	    putch('#');
+	    put_uint(NUM_VALUE(a));
+	    return;
+	}
+#endif
+
+	putch('(');
+	print_atom(NODE_FUNC(a));
+	putch(' ');
+	if (print_reduced && IS_LIT(NODE_FUNC(a)) 
+	    && LIT_REQARGS(ATOM_TO_LIT(NODE_FUNC(a))) == 0) {
+	    NODE_ARG(a) = reduce(NODE_ARG(a));
+	}
+	print_atom(NODE_ARG(a));
+	putch(')');
+    }
+}
+
+void print_atom_reduced(atom a) __z88dk_fastcall
+{
+    print_reduced = 1;
+    print_atom(a);
+    print_reduced = 0;
+}
+
+#define App alloc_app
+
+atom read_atom();
+
+#ifndef TINY_VERSION
+atom string_to_atom(const char *cp) __z88dk_fastcall
+{
+    atom a;
+    void* saved_context = input_context;
+    short(*saved_getch)(void) = getch;
+    short(*saved_ungetch)(char c) = ungetch;
+    /*  printf("input_context := %p, (was %p)\n", input_context, &cp); */
+    input_context = (void*) &cp;
+    getch = sgetchar;
+    ungetch = sungetchar;
+    a = read_atom();
+    input_context = saved_context;
+    getch = saved_getch;
+    ungetch = saved_ungetch;
+    return a;
+}
+
+const char* builtins[][2] = {
+    { "t", "K" },
+    { "f", "F" },
+    { "and", "@@CCF" },
+    { "or", "@JK" },
+    { "not", "@@C@JFK" },
+    { "fst", "@JK" },
+    { "snd", "@JF" },
+    { "div2", "@@BC@@C@@BC@@C@@BB@J@@B@SBC@@BKKI" },
+    { "cdiv", "@@C@@BB@@C@J@J@@BJ@SB@JF@@B@S@@C@J@J@@BJ@@BKJ@JK@@C@@BC@@BJ@@B@B@C@@BBS@@B@B@S@@BBB@@B@B@BC@@B@BC@@B@CB@@C@@BB@J@@C@JKI@@BKJ@KF" },
+    { "fdiv", "@@B@B$pred@@B$ceiling$div$succ" },
+    { "divrem2", "@@C@J@J@@C@@BS@@B@B$pair@@S@@BC@@BJ$succ I$not@@$pair#0$f" },
+    { "tobinle", "@Y@@B@C$divrem2@@B@B@C$cons@S@@C$iszero$nil" },
+    { "tobinbe", "@@B$rev$tobinle" },
+    { "lesseq", "@@B@B$iszero$sub" },
+    { "less", "@@B@B$not@@B@B$iszero@C$sub" },
+    { "greatereq", "@C$lesseq" },
+    { "greater", "@C$less" },
+    { "nil", "@KK" },
+    { "hd", "$fst" },
+    { "tl", "$snd" },
+    { "take", "@@C@@BC@@C@@BC@@C@@BB@J@@SI@@C@@BC@@B@BC@C@@BC@@BJ@@B@B@BK@@B@B@BK@@B@BC@@B@BJ@@C@@BBB$pair I@C@JIK@KK" },
+    { "drop", "@J$tl" },
+    { "nth", "@@B@B$hd$drop" },
     { "zipwith", "@Y@@B@B@C@@BB@@C$case$nil@@B@B@C@@BB@@BB@@C$case$nil@S@@BC@@B@BB@@B@BC@@B@B@BB@B@B$cons" },
     { "zipapp", "@Y@@B@C@@BB@@C$case$nil@@B@C@@BB@@BB@@C$case$nil@C@@BB@@BC@@B@BB@B$cons" },
     { "zip", "@$zipwith$pair" },
@@ -456,7 +1673,7 @@ const char* builtins[][2] = {
     { "map", "@@BY@@B@B@C@@C$case$nil@@BC@@B@BB@B$cons" },
     { "filter", "@@BY@@B@B@C@@C$case$nil@@BC@@B@BB@@C@@BC@@CS$cons I" },
     { "append", "@Y@@B@C@@BS$case@@B@B@C@@BB$cons C" },
-    { "partition", "@Y@@B@B@S@@C@J@K@KF@@C@J@KK@KK@@B@BJ@@C@@BS@@B@BB@BC@@C@@BS@@B@BS@@B@B@BS@@C@@BS@@B@BB@BB@@B@BC@@B@BJ@@BCJ@@B@C@@BB@@BCJ@@BCJ" },
+    { "partition", "@Y@@B@B@S@@C@J@K@KF@@C@J@KK@KK@@B@BJ@@C@@BS@@B@BB@BC@@C@@BS@@B@BS@@B@B@BS@@C@@BS@@B@BB@BB@@B@BC@@B@BJ$pair@@B@C@@BB$pair$pair" },
     { "quicksort", "@@BY@@B@B@C@@C$case@KK@@C@@BB@@BS@@B@BC@B$partition@@S@@BB@@BB@@BC@B$append@C@@BB$cons" },
     { "rev", "@@$foldl@C$cons$nil" },
     { "natsfrom", "@Y@@B@S$cons@@CB$succ" },
@@ -466,8 +1683,7 @@ const char* builtins[][2] = {
     { "exlist1", "@@$cons#0@@$cons#1@@$cons#2$nil" },
     { "exlist2", "@@$cons#2@@$cons#0@@$cons#7@@$cons#5@@$cons#1@@$cons#3@@$cons#6$nil" },
     { "fib", "@@C@@C@J@@S@@BC@@BJ@JF@@S@@BS@@B@BB@JK@JF@@C@JFIK" },
-    { "fact", "@@C@@C@J@@B@SB@@CB@SBFI" },
-    { "tnpo", "@@B@Y@@BJ@@C@@BC@@B@BC@@B@C@@BB@J@@CB@SB@@B@S@@BS@C@@C@@C@@C@J@@BKJK#0@@C@JK@K#0@@C@@BBB@@B@C@@BC@@BJ@@S@@S@@C@J@@C@J#0KK@@BC@@C@@BC@@C@@BB@J@@B@SBC@@BKKI@@B@SB@@S@@BS@BB@@S@@BS@BBI@SB#0@@C@@BCJ#0" },
+    { "tnpo", "@@B@Y@@BJ@@C@@BC@@B@BC@@B@C@@BB@J@@CB@SB@@B@S@@BS@C@@C@@C@@C@J@@BKJK#0@@C@JK@K#0@@C@@BBB@@B@C@@BC@@BJ@@S@@S@@C@J@@C@J#0KK@@BC@@C@@BC@@C@@BB@J@@B@SBC@@BKKI@@B@SB@@S@@BS@BB@@S@@BS@BBI@SB#0@@C$pair#0" },
     { "blc", "@Y@@B@BJ@@B@B@B@SI@@S@@BS@@B@BC@@B@B@BB@@B@B@BS@@B@B@CB@@S@@BBB@@B@S@@BC@@B@BS@@B@CB@@CB@@C@@BBB@C$pair@@C@@BBB@@C@@BBBS@@B@S@@BB@@BS@@B@SI@@CBJ@@B@B@B@BK@@B@BC@@C@@BBB@@C@@BBB@@B@CBJ" },
     { "runblc", "@$blc K" },
     { "rjot", "@Y@@B@C@@C$case I@@S@@BC@@B@BS@@B@CB@@B@BS@BK@@C@@BC@@CCSK" },
@@ -478,393 +1694,3845 @@ const char* builtins[][2] = {
     { "allski", "@Y@@B@$cons I@@B@$cons K@@B@$cons S$diagapp" },
     { "allskibc", "@Y@@B@$cons I@@B@$cons K@@B@$cons B@@B@$cons C@@B@$cons S$diagapp" }
 };
+
+#ifdef MULTIPLE_ENGINES
+/*
+ * Abandoning a term mid-reduction (see the REPL) can't free its graph by
+ * refcount, as the reducers it was in held references of their own, and
+ * may have left counts half updated.  Instead we mark what the macros can
+ * still reach, which is all that outlives a term, count its references
+ * afresh, and free everything else: nodes, boxes and memory blocks.
+ */
+
+struct marker {
+    uint8_t* marked;		/* by node index */
+    atom* stack;
+    uint16_t len;
+    union mem_header* kept;	/* blocks still in use */
+};
+
+void mark_atom(struct marker* m, atom a)
+{
+    if (!IS_LIT(a) && !m->marked[ATOM_TO_INDEX(a)]) {
+	m->marked[ATOM_TO_INDEX(a)] = 1;
+	m->stack[m->len++] = a;
+    }
+}
+
+/* Takes the block out of the engine's list, to be put back later. */
+void keep_mem(struct marker* m, void* mem)
+{
+    union mem_header* h = (union mem_header*) mem - 1;
+    unlink_mem(h);
+    h->link.next = m->kept;
+    m->kept = h;
+}
+
+void mark_map(struct marker* m, struct map_node* n)
+{
+    uint8_t i;
+    if (n == NULL)
+	return;
+    for (i = 0; i < n->count; ++i) {
+	if (n->entries[i].child)
+	    mark_map(m, n->entries[i].child);
+	else
+	    mark_atom(m, n->entries[i].value);
+    }
+}
+
+/* Counts a reference to a map node, keeping it on the first. */
+void count_map(struct marker* m, struct map_node* n)
+{
+    uint8_t i;
+    if (n == NULL || n->refcount++ > 0)
+	return;
+    keep_mem(m, n);
+    for (i = 0; i < n->count; ++i) {
+	if (n->entries[i].child)
+	    count_map(m, n->entries[i].child);
+	else
+	    ++NODE_REFCOUNT(n->entries[i].value);
+    }
+}
+
+void zero_map(struct map_node* n) __z88dk_fastcall
+{
+    uint8_t i;
+    if (n == NULL)
+	return;
+    n->refcount = 0;
+    for (i = 0; i < n->count; ++i)
+	if (n->entries[i].child)
+	    zero_map(n->entries[i].child);
+}
+
+#define COUNT_REF(a) if (!IS_LIT(a)) ++NODE_REFCOUNT(a)
+
+uint8_t release_term(void)
+{
+    struct marker m;
+    uint16_t i, j, n = 0;
+    short num_macros = sizeof(builtins)/sizeof(*builtins);
+    m.marked = calloc(MAX_APPS, 1);
+    m.stack = malloc(MAX_APPS * sizeof(atom));
+    m.len = 0;
+    m.kept = NULL;
+    if (m.marked == NULL || m.stack == NULL) {
+	free(m.marked);
+	free(m.stack);
+	return 0;
+    }
+    for (i = 0; ENGINE.macros != NULL && i < num_macros; ++i)
+	if (ENGINE.macros[i] != NOT_REDUCED)
+	    mark_atom(&m, ENGINE.macros[i]);
+    while (m.len > 0) {
+	atom a = m.stack[--m.len];
+	struct box* b;
+	NODE_REFCOUNT(a) = 0;
+	mark_atom(&m, NODE_FUNC(a));
+	mark_atom(&m, NODE_ARG(a));
+	if (!IS_BOX(a))
+	    continue;
+	b = &BOX_OF(a);
+	switch (ATOM_TO_LIT(NODE_FUNC(a))) {
+	case LIT_STR:
+	    b->u.str.buf->refcount = 0;
+	    break;
+	case LIT_ARR:
+	    b->u.arr.buf->refcount = 0;
+	    for (j = 0; j < b->u.arr.buf->len; ++j)
+		mark_atom(&m, b->u.arr.buf->elems[j]);
+	    break;
+	case LIT_MAP:
+	    zero_map(b->u.map.root);
+	    mark_map(&m, b->u.map.root);
+	    break;
+#ifdef USE_POSIX
+	case LIT_SPARK:
+	    mark_atom(&m, b->u.spark.thunk);
+	    break;
+#endif
+	}
+    }
+    /* Now count the references, and keep the blocks, of what's marked. */
+    for (i = 0; ENGINE.macros != NULL && i < num_macros; ++i)
+	if (ENGINE.macros[i] != NOT_REDUCED)
+	    COUNT_REF(ENGINE.macros[i]);
+    for (i = 0; i < MAX_APPS; ++i) {
+	atom a = INDEX_TO_ATOM(i);
+	struct box* b;
+	if (!m.marked[i])
+	    continue;
+	COUNT_REF(NODE_FUNC(a));
+	COUNT_REF(NODE_ARG(a));
+	if (!IS_BOX(a))
+	    continue;
+	b = &BOX_OF(a);
+	switch (ATOM_TO_LIT(NODE_FUNC(a))) {
+	case LIT_STR:
+	    if (b->u.str.buf->refcount++ == 0)
+		keep_mem(&m, b->u.str.buf);
+	    break;
+	case LIT_ARR:
+	    if (b->u.arr.buf->refcount++ > 0)
+		break;
+	    keep_mem(&m, b->u.arr.buf);
+	    for (j = 0; j < b->u.arr.buf->len; ++j)
+		COUNT_REF(b->u.arr.buf->elems[j]);
+	    break;
+	case LIT_MAP:
+	    count_map(&m, b->u.map.root);
+	    break;
+#ifdef USE_POSIX
+	case LIT_SPARK:
+	    COUNT_REF(b->u.spark.thunk);
+	    break;
+#endif
+	}
+    }
+    /* Free the rest. */
+    free_all_mem();
+    while (m.kept != NULL) {
+	union mem_header* h = m.kept;
+	m.kept = h->link.next;
+	link_mem(h);
+	ENGINE.mem_bytes += h->link.size;
+    }
+    box_freelist = MAX_BOXES;
+    for (j = MAX_BOXES; j-- > 0; ) {
+	atom owner = boxes[j].owner;
+	if (owner == 0 || !m.marked[ATOM_TO_INDEX(owner)]) {
+	    boxes[j].owner = 0;
+	    boxes[j].u.next_free = box_freelist;
+	    box_freelist = j;
+	}
+    }
+    app_freelist = INDEX_TO_ATOM(MAX_APPS);
+    for (i = MAX_APPS; i-- > 0; ) {
+	atom a = INDEX_TO_ATOM(i);
+	if (m.marked[i]) {
+	    ++n;
+	    continue;
+	}
+	NODE_FUNC(a) = app_freelist;
+	SANITY_CHECKING(NODE_REFCOUNT(a) = 0x8888;)
+	app_freelist = a;
+    }
+    current_apps = n;
+    rs_top_ptr = &red_stack[MAX_STACK];
+    print_reduced = 0;
+    clear_limits();
+    free(m.marked);
+    free(m.stack);
+    return 1;
+}
+#endif
+#endif
+
+#ifndef TINY_VERSION
+/*
+ * Reads the rest of a floating-point literal, such as 3.25 or 6.02e23,
+ * after its integer part and the '.' have been read.  An 'e' straight after
+ * the digits always begins an exponent.  We scale by a power of ten at the
+ * end, so short literals like 0.1 come out correctly rounded.
+ */
+atom read_flt(double mant)
+{
+    signed char c;
+    long exp10 = 0;
+    short i;
+    double scale = 1.0;
+    for (;;) {
+	c = getch();
+	if (c < '0' || c > '9')
+	    break;
+	mant = mant*10 + (c - '0');
+	--exp10;
+    }
+    if (c == 'e') {
+	short exp = 0;
+	char negative = 0;
+	c = getch();
+	if (c == '-' || c == '+') {
+	    negative = (c == '-');
+	    c = getch();
+	}
+	/* Past 999, the result is zero or infinite anyway. */
+	for (; c >= '0' && c <= '9'; c = getch())
+	    if (exp < 1000)
+		exp = exp*10 + (c - '0');
+	exp10 += negative ? -exp : exp;
+    }
+    if (c != -1)
+	ungetch(c);
+    if (exp10 > 999)
+	exp10 = 999;
+    else if (exp10 < -999)
+	exp10 = -999;
+    for (i = exp10 < 0 ? -exp10 : exp10; i > 0; --i)
+	scale *= 10;
+    if (mant == 0.0)
+	return flt_to_atom(0.0);
+    return flt_to_atom(exp10 < 0 ? mant / scale : mant * scale);
+}
+
+/*
+ * Reads a string literal, after its opening quote.  A backslash makes the
+ * next character literal, except that \n is a newline.
+ */
+atom read_str(void)
+{
+    size_t size = 16;
+    size_t len = 0;
+    struct str_buf* buf = alloc_str_buf(size);
+    for (;;) {
+	signed char c = getch();
+	if (c == -1 || c == '"')
+	    break;
+	if (c == '\\') {
+	    c = getch();
+	    if (c == 'n')
+		c = '\n';
+	}
+	if (len == size) {
+	    if (size == MAX_STR_LEN) {
+		free_mem(buf);
+		engine_error("string too long");
+	    }
+	    size = size * 2 < MAX_STR_LEN ? size * 2 : MAX_STR_LEN;
+	    buf = realloc_mem(buf, sizeof(struct str_buf) + size);
+	}
+	buf->data[len++] = c;
+    }
+    buf = realloc_mem(buf, sizeof(struct str_buf) + len);
+    return str_to_atom(buf, 0, len);
+}
+
+signed char getch_nonspace(void)
+{
+    signed char c;
+    do {
+	c = getch();
+    } while (c == ' ' || c == '\n' || c == ')');
+    return c;
+}
+
+/*
+ * Reads an array literal, after its opening bracket.
+ */
+atom read_arr(void)
+{
+    struct arr_buf* buf = alloc_arr_buf(0);
+    for (;;) {
+	signed char c = getch_nonspace();
+	if (c == -1 || c == ']')
+	    break;
+	ungetch(c);
+	buf = arr_buf_append(buf, read_atom());
+    }
+    return arr_to_atom(buf, 0, buf->len);
+}
+
+/*
+ * Reads a map literal, after its opening brace.  Keys and values
+ * alternate, and keys that aren't literals are treated as zero.
+ */
+atom read_map(void)
+{
+    struct map_node* root = NULL;
+    uint16_t size = 0;
+    for (;;) {
+	signed char c = getch_nonspace();
+	atom key;
+	struct map_node* new_root;
+	char added;
+	if (c == -1 || c == '}')
+	    break;
+	ungetch(c);
+	key = read_atom();
+	new_root = map_insert(root, IS_LIT(key) ? ATOM_TO_LIT(key) : 0,
+			      read_atom(), 0, &added);
+	free_app_all(key);
+	free_map_node(root);
+	root = new_root;
+	size += added;
+    }
+    return map_to_atom(root, size);
+}
+#endif
+
+/*
+ * The REPL mentions what it doesn't understand and carries on, whereas
+ * elsewhere (with somewhere to unwind to) it's noted so that the parse can
+ * fail.
+ */
+#ifdef MULTIPLE_ENGINES
+#define PARSE_ERROR(msg, fmt, arg) (ENGINE.on_error != NULL		\
+				    ? (void) (ENGINE.error = (msg))	\
+				    : (void) printf(fmt, arg))
+#else
+#define PARSE_ERROR(msg, fmt, arg) printf(fmt, arg)
+#endif
+
+atom read_atom()
+{
+    signed char c;
+again:
+    SANITY_CHECK
+    c = getch();
+    if (c == -1)
+	return LIT_TO_ATOM(LIT_I);
+    switch (c) {
+    case ' ':
+    case ')':
+    case '\n':
+	goto again;
+    case '(':
+    case '@': {
+	atom lhs = read_atom();
+	atom rhs = read_atom();
+	return alloc_app(lhs,rhs);
+    }
+    case '\'':
+	return LIT_TO_ATOM((unsigned char) getch());
+#ifndef TINY_VERSION
+    case '"':
+	return read_str();
+    case '[':
+	return read_arr();
+    case '{':
+	return read_map();
+#endif
+    case '#': {
+        short n = 0;
+	for (;;) {
+	    c = getch();
+	    if (c < '0' || c > '9')
+		break;
+	    n = n*10+(c - '0');
+	}
+	if (c != -1)
+	    ungetch(c);
+#ifndef TINY_VERSION
+	if (n >= 0)
+	    return num_to_atom(n);
+#endif
+	/*  printf("inserted church numeral %d: ",n); */
+	{
+	    atom single_succ = alloc_app(LIT_TO_ATOM(LIT_S),
+					 LIT_TO_ATOM(LIT_B));
+	    atom val = alloc_app(LIT_TO_ATOM(LIT_K),LIT_TO_ATOM(LIT_I));
+	    short i;
+	    for (i = 0; i < n; ++i) {
+		val = alloc_app(copy_atom(single_succ),val);
+	    }
+	    free_app_all(single_succ);
+	    /* print_atom(val); putchar('\n'); */
+	    return val;
+	}
+    }
+#ifndef TINY_VERSION
+    case '$': {
+        char ident[20];
+	char* cp = ident;
+	short i;
+	for (;;) {
+	    c = getch();
+	    if (c < '0' || c > 'z' || (c < 'A' && c > '9')
+		|| (c < 'a' && c > 'Z'))
+		break;
+	    if (cp != ident + sizeof(ident) - 1)
+		*cp++ = c;
+	}
+	if (c != -1) 
+	    ungetch(c);
+	*cp = '\0';
+	for (i = 0; i < ARRAY_SIZE(named_reps); ++i) {
+	    if (!strcmp(ident,named_reps[i].name))
+		return LIT_TO_ATOM(named_reps[i].value);
+	}
+	for (i = 0; i < sizeof(builtins)/sizeof(*builtins); ++i) {
+	    if (!strcmp(ident,builtins[i][0])) {
+#ifdef MULTIPLE_ENGINES
+		if (ENGINE.macros != NULL && ENGINE.macros[i] != NOT_REDUCED)
+		    return copy_atom(ENGINE.macros[i]);
+#endif
+		return string_to_atom(builtins[i][1]);
+	    }
+	}
+	PARSE_ERROR("unknown macro", "Unkown macro: %s\n", ident);
+	goto again;
+    }
+#endif
+    default:
+	if (c >= '0' && c <= '9') {
+	    unsigned short num = 0;
+#ifndef TINY_VERSION
+	    double mant = 0.0;
+#endif
+	    for (;;) {
+		num += c - '0';
+#ifndef TINY_VERSION
+		mant = mant*10 + (c - '0');
+#endif
+		c = getch();
+		if (c < '0' || c > '9')
+		    break;
+		num *= 10;
+	    }
+#ifndef TINY_VERSION
+	    if (c == '.')
+		return read_flt(mant);
+#endif
+	    if (c != -1)
+		ungetch(c);
+	    return LIT_TO_ATOM(num & 0x7fff);
+	}
+	if (c >= 'a' && c <= 'z')
+	    return LIT_TO_ATOM(c);
+	{
+	    unsigned char i;
+	    for (i = 0; i < (unsigned char) ARRAY_SIZE(reps); ++i)
+		if (reps[i].key == (char) c)
+		    return LIT_TO_ATOM(reps[i].value);
+	}
+	PARSE_ERROR("unrecognized character", "Unrecognized char '%c'\n", c);
+	goto again;
+    }
+}
+
+#ifndef MINISK_LIBRARY
+#ifdef USE_POSIX
+extern uint8_t spare_workers;
+extern unsigned int speculate_at, speculate_budget;
+void print_spark_stats(void);
+void reset_workers(uint8_t workers) __z88dk_fastcall;
+void run_batch(FILE* in) __z88dk_fastcall;
+int run_server(const char* path) __z88dk_fastcall;
+#define OPTIONS " [-j processes] [-s budget] [-b file | -S socket]"
+#else
+#define OPTIONS ""
+#endif
+
+#ifdef MULTIPLE_ENGINES
+int main(int argc, char** argv)
+#else
+int main()
+#endif
+{
+#ifdef MULTIPLE_ENGINES
+    /*
+     * Anything that stops a term (a limit, running out of space, or
+     * SIGINT) abandons it, and the heap is started afresh.
+     */
+    jmp_buf on_error;
+    static unsigned int max_reductions = 0, max_nodes = 0;
+    static unsigned long max_millis = 0;
+    int arg;
+#endif
+#ifdef USE_POSIX
+    FILE* batch = NULL;
+    const char* server = NULL;
+    uint8_t workers;
+#endif
+#ifdef MULTIPLE_ENGINES
+    for (arg = 1; arg < argc; ++arg) {
+	if (strcmp(argv[arg], "-r") == 0 && arg+1 < argc) {
+	    max_reductions = (unsigned int) atol(argv[++arg]);
+	} else if (strcmp(argv[arg], "-n") == 0 && arg+1 < argc) {
+	    long n = atol(argv[++arg]);
+	    max_nodes = n < 0 ? 0 : n > MAX_APPS ? MAX_APPS : n;
+	} else if (strcmp(argv[arg], "-t") == 0 && arg+1 < argc) {
+	    max_millis = (unsigned long) atol(argv[++arg]);
+#ifdef USE_POSIX
+	} else if (strcmp(argv[arg], "-j") == 0 && arg+1 < argc) {
+	    int n = atoi(argv[++arg]);
+	    spare_workers = n < 1 ? 0 : n > 255 ? 254 : n-1;
+	} else if (strcmp(argv[arg], "-s") == 0 && arg+1 < argc) {
+	    speculate_budget = (unsigned int) atoi(argv[++arg]);
+	    speculate_at = 0;
+	} else if (strcmp(argv[arg], "-b") == 0 && arg+1 < argc) {
+	    const char* name = argv[++arg];
+	    batch = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	    if (batch == NULL) {
+		perror(name);
+		return 2;
+	    }
+	} else if (strcmp(argv[arg], "-S") == 0 && arg+1 < argc) {
+	    server = argv[++arg];
+#endif
+	} else {
+	    fprintf(stderr, "usage: %s [-r reductions] [-n nodes] [-t ms]"
+		    OPTIONS "\n", argv[0]);
+	    return 2;
+	}
+    }
+#endif
+#ifdef USE_POSIX
+    workers = spare_workers;
+#endif
+#ifdef __Z88DK
+#ifdef __ZXNEXT
+    putchar(14);
+#else
+#ifdef __SPECTRUM
+    zx_cls(PAPER_WHITE);
+#endif
+#endif
+#endif
+    init_engine();
+    SANITY_CHECK
+#ifdef USE_POSIX
+    if (batch != NULL) {
+	run_batch(batch);
+	return 0;
+    }
+    if (server != NULL)
+	return run_server(server);
+#endif
+    printf("Mini-SK, combinators & more...\n");
+#ifndef TINY_VERSION
+    printf("\nPredefined macros");
+    { 
+	int i;
+	char comma = ':';
+	for (i = 0; i < sizeof(builtins)/sizeof(*builtins); ++i) {
+	    printf("%c $%s", comma, builtins[i][0]);
+	    comma = ',';
+	}
+	printf("\n\nNamed combinators");
+	comma = ':';
+	for (i = 0; i < ARRAY_SIZE(named_reps); ++i) {
+	    printf("%c $%s", comma, named_reps[i].name);
+	    comma = ',';
+	}
+    }
+    putchar('\n');
+#endif
+    for(;;) {
+	atom a;
+#ifdef MULTIPLE_ENGINES
+	if (setjmp(on_error)) {
+	    catch_interrupts(0);
+	    ENGINE.on_error = NULL;
+	    printf("\n%s, after %u reductions\n", ENGINE.error, reductions);
+#ifdef USE_POSIX
+	    reset_workers(workers);
+#endif
+	    if (!release_term()) {
+		free_all_mem();
+		init_engine();
+	    }
+	    continue;
+	}
+#endif
+	if (feof(stdin))
+	    break;
+	SANITY_CHECK
+	reductions = 0;
+	max_apps = current_apps;
+#if defined(USE_MINILIB) && defined(__SPECTRUM)
+	input_prompt = "Term> ";
+#else
+	printf("\nTerm> ");
+#endif
+	a = read_atom();
+	putchar('\n');
+	{
+	    char c;
+	    do {
+		c = getch();
+	    } while (c == ' ' || c == ')');
+	    if (c != '\n')
+		ungetch(c);
+	}
+	print_atom(a); printf("\n--->\n");
+    SANITY_CHECK
+#if defined(USE_MINILIB) && defined(__SPECTRUM)
+	input_prompt += 4;
+#endif
+#ifdef MULTIPLE_ENGINES
+	ENGINE.on_error = &on_error;
+	catch_interrupts(1);
+	set_limits(max_reductions, max_nodes, 0, max_millis);
+#endif
+	a = reduce(a);
+    SANITY_CHECK
+	print_atom_reduced(a); putchar('\n');
+    SANITY_CHECK
+#ifdef MULTIPLE_ENGINES
+	clear_limits();
+	catch_interrupts(0);
+	ENGINE.on_error = NULL;
+#endif
+	printf("\n%u reductions, %d max appnodes\n", reductions, max_apps);
+#ifdef USE_POSIX
+	print_spark_stats();
+#endif
+	free_app_all(a);
+    }
+    return 0;
+}
+#endif
+
+
+atom alloc_app(atom func, atom arg)
+{
+    atom next_app = app_freelist;
+    SANITY_CHECK
+    if (next_app == INDEX_TO_ATOM(MAX_APPS))
+	engine_error("out of app space");
+    assert(NODE_REFCOUNT(next_app) == 0x8888);
+    app_freelist = NODE_FUNC(next_app);
+    NODE_FUNC(next_app) = func;
+    NODE_ARG(next_app) = arg;
+    NODE_REFCOUNT(next_app) = 1;
+    debug_printf(("# ALLOC: node= %04x, lhs= %04x, rhs= %04x\n", next_app, func, arg));
+    SANITY_CHECK
+    ++current_apps;
+    if (current_apps > max_apps) {
+	max_apps = current_apps;
+#ifdef MULTIPLE_ENGINES
+	if (max_apps > ENGINE.app_limit)
+	    engine_error("node limit reached");
+#endif
+    }
+    return next_app;
+}
+
+void free_app(atom app) __z88dk_fastcall
+{
+    SANITY_CHECK
+    assert(NODE_REFCOUNT(app) != 0x8888);
+    NODE_FUNC(app) = app_freelist;
+    app_freelist = app;
+    --current_apps;
+    SANITY_CHECKING(NODE_REFCOUNT(app) = 0x8888;)
+    debug_printf(("# FREE: node= %04x, lhs= %04x, rhs= %04x\n", app, NODE_FUNC(app), NODE_ARG(app)));
+}
+
+char free_app_all(atom app) __z88dk_fastcall
+{
+    SANITY_CHECK
+    if (IS_LIT(app))
+	return 0;
+    debug_printf(("# DEC: node= %04x, lhs= %04x, rhs= %04x\n", app, NODE_FUNC(app), NODE_ARG(app)));
+    if (--NODE_REFCOUNT(app))
+	return 0;
+#ifndef TINY_VERSION
+    if (IS_BOX(app))
+	free_box(app);
+#endif
+    free_app_all(NODE_ARG(app));
+    free_app_all(NODE_FUNC(app));
+    free_app(app);
+    return 1;
+}
+
+atom copy_atom(atom a) __z88dk_fastcall
+{
+    SANITY_CHECK
+    if (IS_LIT(a))
+	return a;
+    debug_printf(("# INC: node= %04x, lhs= %04x, rhs= %04x\n", a, NODE_FUNC(a), NODE_ARG(a)));
+    assert(NODE_REFCOUNT(a) != 0x8888);
+    assert(NODE_REFCOUNT(a) != 0x9e37);
+    ++NODE_REFCOUNT(a);
+    return a;
+}
+
+atom replace(atom orig, atom reduced)
+{
+    if (!free_app_all(orig)) {
+	copy_atom(reduced);
+	free_app_all(NODE_FUNC(orig));
+	free_app_all(NODE_ARG(orig));
+	NODE_FUNC(orig) = LIT_TO_ATOM(LIT_I);
+	NODE_ARG(orig)  = reduced;
+    }
+    return reduced;
+}
+
+#ifdef USE_MINILIB
+#ifdef TINY_VERSION
+atom* rs_top_ptr = (atom*) 0x8000;
+const atom* red_stack  = ((atom*) 0x7000);
+#else
+atom* rs_top_ptr = (atom*) 0xff20;
+const atom* red_stack  = ((atom*) 0xef20);
+#endif
+#endif
+
+typedef atom (*reducer_fn)(atom curr) __z88dk_fastcall;
+
+atom red_ident(atom curr) __z88dk_fastcall
+{
+    return replace(curr, copy_atom(NODE_ARG(curr)));
+}
+
+atom red_const(atom curr) __z88dk_fastcall
+{
+    return replace(curr, copy_atom(NODE_ARG(rs_top_ptr[0])));
+}
+
+atom red_false(atom curr) __z88dk_fastcall
+{
+    return replace(curr, copy_atom(NODE_ARG(curr)));
+}
+
+atom red_jump(atom curr) __z88dk_fastcall
+{
+    atom yx = alloc_app(copy_atom(NODE_ARG(curr)), 
+			copy_atom(NODE_ARG(rs_top_ptr[0])));
+    return replace(curr, yx);
+}
+
+#ifdef USE_POSIX
+/* With -s, (g x) is sometimes evaluated speculatively, see speculate. */
+unsigned int speculate_at = (unsigned int) -1;
+void speculate(atom x) __z88dk_fastcall;
+#endif
+
+atom red_fusion(atom curr) __z88dk_fastcall
+{
+    atom fx = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[0])),
+			copy_atom(NODE_ARG(curr)));
+    atom gx = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[1])),
+			copy_atom(NODE_ARG(curr)));
+#ifdef USE_POSIX
+    if (reductions >= speculate_at)
+	speculate(gx);
+#endif
+    return replace(curr,alloc_app(fx,gx));
+}
+
+atom red_compose(atom curr) __z88dk_fastcall
+{
+    atom f  = copy_atom(NODE_ARG(rs_top_ptr[0]));
+    atom gx = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[1])),
+			copy_atom(NODE_ARG(curr)));
+    return replace(curr,alloc_app(f,gx));
+}
+
+atom red_flip(atom curr) __z88dk_fastcall
+{
+    atom fy = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[0])),
+			copy_atom(NODE_ARG(curr)));
+    atom x  = copy_atom(NODE_ARG(rs_top_ptr[1]));
+    return replace(curr,alloc_app(fy,x));
+}
+
+atom red_y(atom curr) __z88dk_fastcall
+{
+    /*
+     * Note: It migtht be tempting to write
+     *     return replace(curr,alloc_app(copy_atom(NODE_ARG(curr)),
+     *      				       copy_atom(curr))); 
+     * but that would make a cycle, and that's not cool given that we use
+     * reference countining.  Thus this is one of the few rules where we
+     * don't use replace.
+     */
+    return alloc_app(copy_atom(NODE_ARG(curr)), curr);
+}
+
+#ifdef USE_POSIX
+char in_worker = 0;
+
+/* Workers can't do I/O, so they give up, and leave it to their parent. */
+#define CHECK_NOT_WORKER() if (in_worker) abandon_worker()
+void abandon_worker(void);
+#else
+#define CHECK_NOT_WORKER()
+#endif
+
+atom red_putchar(atom curr) __z88dk_fastcall
+{
+    atom reduced;
+    CHECK_NOT_WORKER();
+    reduced = reduce(NODE_ARG(curr));
+    NODE_ARG(curr) = reduced;
+    io_putchar(IS_LIT(reduced) ? LIT_SUBTYPE(ATOM_TO_LIT(reduced)) : '*');
+    return replace(curr,copy_atom(NODE_ARG(rs_top_ptr[0])));
+}
+
+atom red_getchar(atom curr) __z88dk_fastcall
+{
+    atom arg0 = NODE_ARG(curr);
+    atom result;
+    CHECK_NOT_WORKER();
+    /* The end of the input, -1, wraps like other numbers do. */
+    result = LIT_TO_ATOM(io_getchar() & 0x7fff);
+    return replace(curr, alloc_app(copy_atom(arg0), result));
+}
+
+#ifndef TINY_VERSION
+/*
+ * Reduces the argument of an app node, leaving the result in its place.
+ */
+atom reduce_arg(atom app) __z88dk_fastcall
+{
+    atom reduced = reduce(NODE_ARG(app));
+    NODE_ARG(app) = reduced;
+    return reduced;
+}
+#endif
+
+#ifdef USE_POSIX
+/*
+ * Parallel evaluation.
+ *
+ * Both operands of arithmetic will certainly be needed, so while we reduce
+ * the left one, a worker process can reduce the right one.  Starting a
+ * process costs as much as thousands of reductions, so we only do so once
+ * the left operand has taken FORK_GRAIN reductions without finishing.
+ * Each operator records a fork site before reducing its operands, and
+ * reduce checks the oldest site that has no worker from time to time.
+ * The worker is a copy of this process, made by fork, which carries on
+ * from the site, reduces the right operand, sends the result back through
+ * a pipe, and exits.  If it can't send the result (it isn't a number), or
+ * tries to do I/O, it gives up, and the operand is reduced here as usual.
+ *
+ * Workers have their own copy of the heap, so a thunk shared by both
+ * operands may be reduced twice, but if we reduce the right operand
+ * ourselves before the worker finishes (through sharing), the worker is
+ * stopped.  With -j n, there are at most n processes, each worker being
+ * given a share of its parent's spare workers to use for its own sites.
+ */
+
+#ifndef FORK_GRAIN
+#define FORK_GRAIN 20000
+#endif
+
+#define MAX_SITES 64
+
+struct fork_site {
+    atom app;		/* whose argument is the right operand */
+    atom* rs_top;
+    unsigned int start;	/* reductions when the site was recorded */
+    pid_t pid;		/* or 0 if there's no worker */
+    int fd;
+    uint8_t share;	/* spare workers given to the worker */
+};
+
+struct worker_result {
+    char kind;		/* 'l' for a literal, 'f' for a float */
+    literal lit;
+    double flt;
+    unsigned int num_reductions;
+};
+
+struct fork_site fork_sites[MAX_SITES];
+uint8_t num_sites = 0;
+uint8_t next_site = 0;	/* sites below this have workers, or can't */
+uint8_t spare_workers = 0;
+unsigned int fork_check_at = (unsigned int) -1;
+unsigned int budget_at = (unsigned int) -1;	/* for speculation */
+int worker_fd;
+
+/*
+ * Workers, sites and sparks belong to the process, not to an engine, so
+ * only the default engine may use them.  Any other (a library's, or a
+ * server session's) evaluates on its own, as without -j.
+ */
+#ifdef MULTIPLE_ENGINES
+#define USES_WORKERS (engine == &default_engine)
+#else
+#define USES_WORKERS 1
+#endif
+
+void update_fork_check(void)
+{
+    fork_check_at = next_site < num_sites && spare_workers > 0
+	? fork_sites[next_site].start + FORK_GRAIN : (unsigned int) -1;
+    if (budget_at < fork_check_at)
+	fork_check_at = budget_at;
+}
+
+void stop_workers(void)
+{
+    uint8_t i;
+    for (i = 0; i < num_sites; ++i) {
+	if (fork_sites[i].pid != 0) {
+	    kill(fork_sites[i].pid, SIGKILL);
+	    close(fork_sites[i].fd);
+	    waitpid(fork_sites[i].pid, NULL, 0);
+	}
+    }
+}
+
+void abandon_worker(void)
+{
+    stop_workers();
+    _exit(3);
+}
+
+void forget_sparks(void);
+
+/* Sets up a new worker, which carries on from a site or a spark. */
+void start_worker(int fd, uint8_t share)
+{
+    uint8_t i;
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0)
+	dup2(null_fd, 2);
+#ifdef MULTIPLE_ENGINES
+    ENGINE.on_error = NULL;
+#endif
+    for (i = 0; i < num_sites; ++i)
+	if (fork_sites[i].pid != 0)
+	    close(fork_sites[i].fd);
+    num_sites = next_site = 0;
+    forget_sparks();
+    spare_workers = share;
+    reductions = 0;
+    in_worker = 1;
+    worker_fd = fd;
+    update_fork_check();
+}
+
+void finish_worker(atom result) __z88dk_fastcall
+{
+    struct worker_result msg;
+    char* p = (char*) &msg;
+    size_t left = sizeof(msg);
+    msg.kind = 0;
+    msg.num_reductions = reductions;
+    if (IS_LIT(result)) {
+	msg.kind = 'l';
+	msg.lit = ATOM_TO_LIT(result);
+    } else if (IS_BOXED(result, LIT_FLT)) {
+	msg.kind = 'f';
+	msg.flt = BOX_OF(result).u.flt;
+    }
+    /* Anything short of the whole message makes the parent do it itself. */
+    while (msg.kind != 0 && left > 0) {
+	ssize_t n = write(worker_fd, p, left);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	p += n;
+	left -= n;
+    }
+    _exit(0);
+}
+
+/*
+ * Called by reduce when the oldest site may be worth a worker, or when a
+ * speculative worker has used up its budget.
+ */
+void fork_worker(void)
+{
+    struct fork_site* site = &fork_sites[next_site++];
+    int fds[2];
+    if (reductions >= budget_at)
+	abandon_worker();
+    if (!IS_LIT(NODE_ARG(site->app)) && pipe(fds) == 0) {
+	uint8_t share = (spare_workers - 1) / 2;
+	fflush(stdout);
+	site->pid = fork();
+	if (site->pid == 0) {
+	    /* Starting the worker frees the site for its own use. */
+	    atom app = site->app;
+	    close(fds[0]);
+	    rs_top_ptr = site->rs_top;
+	    start_worker(fds[1], share);
+	    finish_worker(reduce(NODE_ARG(app)));
+	}
+	close(fds[1]);
+	if (site->pid > 0) {
+	    site->fd = fds[0];
+	    site->share = share;
+	    spare_workers -= share + 1;
+	} else {
+	    site->pid = 0;
+	    close(fds[0]);
+	}
+    }
+    update_fork_check();
+}
+
+/*
+ * Uses the worker's result for the right operand, unless it's already been
+ * reduced here.
+ */
+void join_worker(struct fork_site* site) __z88dk_fastcall
+{
+    atom rhs = NODE_ARG(site->app);
+    struct worker_result msg;
+    if (!IS_LIT(rhs) && NODE_FUNC(rhs) == LIT_TO_ATOM(LIT_I)) {
+	kill(site->pid, SIGKILL);
+    } else if (read(site->fd, &msg, sizeof(msg)) == sizeof(msg)) {
+	free_app_all(rhs);
+	NODE_ARG(site->app) = msg.kind == 'l' ? LIT_TO_ATOM(msg.lit)
+	    : flt_to_atom(msg.flt);
+	reductions += msg.num_reductions;
+    }
+    close(site->fd);
+    waitpid(site->pid, NULL, 0);
+    spare_workers += site->share + 1;
+}
+
+/*
+ * Reduces the operands of a two-operand operator, left then right, leaving
+ * the results in place, but with the right one maybe done by a worker.
+ */
+void reduce_operands(atom curr) __z88dk_fastcall
+{
+    struct fork_site* site;
+    if (spare_workers == 0 || !USES_WORKERS || num_sites == MAX_SITES) {
+	reduce_arg(rs_top_ptr[1]);
+	reduce_arg(curr);
+	return;
+    }
+    site = &fork_sites[num_sites];
+    site->app = curr;
+    site->rs_top = rs_top_ptr;
+    site->start = reductions;
+    site->pid = 0;
+    if (num_sites++ == next_site)
+	update_fork_check();
+    reduce_arg(rs_top_ptr[1]);
+    if (site->pid != 0)
+	join_worker(site);
+    --num_sites;
+    if (next_site > num_sites)
+	next_site = num_sites;
+    update_fork_check();
+    reduce_arg(curr);
+}
+#endif
+
+
+literal eval_two_lits(atom curr) __z88dk_fastcall
+{
+    atom reduced_lhs, reduced_rhs;
+#ifdef USE_POSIX
+    reduce_operands(curr);
+    reduced_lhs = NODE_ARG(rs_top_ptr[1]);
+    reduced_rhs = NODE_ARG(curr);
+#else
+    reduced_lhs = reduce(NODE_ARG(rs_top_ptr[1]));
+    NODE_ARG(rs_top_ptr[1]) = reduced_lhs;
+    reduced_rhs = reduce(NODE_ARG(curr));
+    NODE_ARG(curr) = reduced_rhs;
+#endif
+    /* Only set now, as reducing the rhs may do arithmetic too. */
+    other_lit = IS_LIT(reduced_lhs) ? ATOM_TO_LIT(reduced_lhs) : 0;
+    return  IS_LIT(reduced_rhs) ? ATOM_TO_LIT(reduced_rhs) : 0;
+}
+
+atom builtin_2c_result(atom result) __z88dk_fastcall
+{
+    atom arg0 = NODE_ARG(rs_top_ptr[0]);
+    if (arg0 == LIT_TO_ATOM(LIT_I)) {
+	return replace(rs_top_ptr[2], result);
+    } else {
+	return replace(rs_top_ptr[2], alloc_app(copy_atom(arg0), result));
+    }
+}
+
+#ifndef TINY_VERSION
+literal apply_arith(literal op, literal lhs, literal rhs)
+{
+    switch (op) {
+    case LIT_pl:
+	return (lhs+rhs) & 0x7fff;
+    case LIT_mi:
+	return (lhs-rhs) & 0x7fff;
+    case LIT_tm:
+	return (lhs*rhs) & 0x7fff;
+    case LIT_dv:
+	if (rhs == 0)
+	    engine_error("division by zero");
+	return (lhs/rhs) & 0x7fff;
+    case LIT_eq:
+	return lhs == rhs ? LIT_K : LIT_F;
+    default:
+	return lhs < rhs ? LIT_K : LIT_F;
+    }
+}
+
+#define IS_ARITH(a) ((a) == LIT_TO_ATOM(LIT_pl) || (a) == LIT_TO_ATOM(LIT_mi) \
+		     || (a) == LIT_TO_ATOM(LIT_tm) || (a) == LIT_TO_ATOM(LIT_dv) \
+		     || (a) == LIT_TO_ATOM(LIT_eq) || (a) == LIT_TO_ATOM(LIT_lt))
+
+/*
+ * If k is (((NUM n) ((C op) a)) k2), applies (op a) to the result n
+ * times and returns 1, or returns 0 if k isn't like that.
+ */
+char num_arith_chain(atom k, literal* resultp)
+{
+    atom f = reduce_arg(NODE_FUNC(k));
+    atom op, a;
+    literal n, result = *resultp;
+    if (IS_LIT(f) || IS_LIT(NODE_FUNC(f))
+	|| NODE_FUNC(NODE_FUNC(f)) != LIT_TO_ATOM(LIT_C))
+	return 0;
+    op = NODE_ARG(NODE_FUNC(f));
+    a = reduce_arg(f);
+    if (!IS_ARITH(op) || !IS_LIT(a))
+	return 0;
+    n = NUM_VALUE(NODE_FUNC(NODE_FUNC(k)));
+    reductions += n;
+    for (; n > 0; --n)
+	result = apply_arith(ATOM_TO_LIT(op), ATOM_TO_LIT(a), result);
+    *resultp = result;
+    return 1;
+}
+
+/*
+ * Passes the result of integer arithmetic on to the continuation.  If the
+ * continuation is itself arithmetic waiting for its last operand, as in
+ * ((+ k) a) or ((C (+ k)) a) (what ((C +) 1) gives when applied to k), we
+ * do that sum right here and carry on with k, so a chain of sums only
+ * builds its final result.  A numeral applying ((C +) a), say, n times
+ * to k can be done with a loop.  We take the continuation out of the spine as
+ * we go, so each link can be freed as soon as we're done with it, but
+ * that's only safe if nothing else can see the spine (much as for $aset).
+ */
+atom arith_result(literal result)
+{
+    atom k;
+    if (NODE_REFCOUNT(rs_top_ptr[0]) != 1 || NODE_REFCOUNT(rs_top_ptr[1]) != 1)
+	return builtin_2c_result(LIT_TO_ATOM(result));
+    k = NODE_ARG(rs_top_ptr[0]);
+    NODE_ARG(rs_top_ptr[0]) = LIT_TO_ATOM(LIT_I);
+    for (;;) {
+	atom inner, operand, next;
+	char flipped = 0;
+	if (!IS_LIT(k) && !IS_LIT(NODE_FUNC(k)) && IS_NUM(NODE_FUNC(NODE_FUNC(k)))
+	    && num_arith_chain(k, &result)) {
+	    next = copy_atom(NODE_ARG(k));
+	    free_app_all(k);
+	    k = next;
+	}
+	k = reduce(k);
+	if (IS_LIT(k))
+	    break;
+	inner = NODE_FUNC(k);
+	if (IS_LIT(inner))
+	    break;
+	if (NODE_FUNC(inner) == LIT_TO_ATOM(LIT_C)) {
+	    inner = reduce_arg(inner);
+	    if (IS_LIT(inner))
+		break;
+	    flipped = 1;
+	}
+	if (!IS_ARITH(NODE_FUNC(inner)))
+	    break;
+	operand = reduce_arg(k);
+	if (!IS_LIT(operand))
+	    operand = LIT_TO_ATOM(0);
+	result = flipped
+	    ? apply_arith(ATOM_TO_LIT(NODE_FUNC(inner)), result,
+			  ATOM_TO_LIT(operand))
+	    : apply_arith(ATOM_TO_LIT(NODE_FUNC(inner)), ATOM_TO_LIT(operand),
+			  result);
+	++reductions;
+	next = copy_atom(NODE_ARG(inner));
+	free_app_all(k);
+	k = next;
+    }
+    if (k == LIT_TO_ATOM(LIT_I))
+	return replace(rs_top_ptr[2], LIT_TO_ATOM(result));
+    return replace(rs_top_ptr[2], alloc_app(k, LIT_TO_ATOM(result)));
+}
+#else
+#define arith_result(result) builtin_2c_result(LIT_TO_ATOM(result))
+#endif
+
+atom red_plus(atom curr) __z88dk_fastcall
+{
+    literal rhs_lit = eval_two_lits(curr);
+    return arith_result((other_lit+rhs_lit) & 0x7fff);
+}
+
+atom red_minus(atom curr) __z88dk_fastcall
+{
+    literal rhs_lit = eval_two_lits(curr);
+    return arith_result((other_lit-rhs_lit) & 0x7fff);
+}
+
+atom red_times(atom curr) __z88dk_fastcall
+{
+    literal rhs_lit = eval_two_lits(curr);
+    return arith_result((other_lit*rhs_lit) & 0x7fff);
+}
+
+atom red_div(atom curr) __z88dk_fastcall
+{
+    literal rhs_lit = eval_two_lits(curr);
+    if (rhs_lit == 0)
+	engine_error("division by zero");
+    return arith_result((other_lit/rhs_lit) & 0x7fff);
+}
+
+atom red_eq(atom curr) __z88dk_fastcall
+{
+    literal rhs_lit = eval_two_lits(curr);
+    return arith_result(other_lit==rhs_lit ? LIT_K : LIT_F);
+}
+
+atom red_lt(atom curr) __z88dk_fastcall
+{
+    literal rhs_lit = eval_two_lits(curr);
+    return arith_result(other_lit < rhs_lit ? LIT_K : LIT_F);
+}
+
+#ifndef TINY_VERSION
+/*
+ * A builtin finds its i'th argument, counting from zero, in
+ * NODE_ARG(rs_top_ptr[i]), where lazy arguments can be used as they
+ * are.  Strict literal arguments can be fetched with lit_arg, which
+ * leaves the reduced value in place, and treats anything that isn't a
+ * literal as zero.  Builtins whose argument zero is a continuation, k,
+ * followed by n operands, pass their result to k with builtin_nc_result.
+ */
+literal lit_arg(uint8_t i) __z88dk_fastcall
+{
+    atom reduced = reduce_arg(rs_top_ptr[i]);
+    return IS_LIT(reduced) ? ATOM_TO_LIT(reduced) : 0;
+}
+
+atom builtin_nc_result(uint8_t n, atom result)
+{
+    atom arg0 = NODE_ARG(rs_top_ptr[0]);
+    if (arg0 == LIT_TO_ATOM(LIT_I)) {
+	return replace(rs_top_ptr[n], result);
+    } else {
+	return replace(rs_top_ptr[n], alloc_app(copy_atom(arg0), result));
+    }
+}
+
+atom builtin_1c_result(atom result) __z88dk_fastcall
+{
+    return builtin_nc_result(1, result);
+}
+
+atom builtin_3c_result(atom result) __z88dk_fastcall
+{
+    return builtin_nc_result(3, result);
+}
+
+/*
+ * Floating-point arithmetic works just like the integer kind, except that
+ * the results are boxed.
+ */
+
+
+double eval_two_flts(atom curr) __z88dk_fastcall
+{
+#ifdef USE_POSIX
+    reduce_operands(curr);
+    other_flt = atom_to_flt(NODE_ARG(rs_top_ptr[1]));
+    return atom_to_flt(NODE_ARG(curr));
+#else
+    atom reduced_lhs = reduce(NODE_ARG(rs_top_ptr[1]));
+    NODE_ARG(rs_top_ptr[1]) = reduced_lhs;
+    {
+	atom reduced_rhs = reduce(NODE_ARG(curr));
+	NODE_ARG(curr) = reduced_rhs;
+	other_flt = atom_to_flt(reduced_lhs);
+	return atom_to_flt(reduced_rhs);
+    }
+#endif
+}
+
+atom red_fadd(atom curr) __z88dk_fastcall
+{
+    double rhs_flt = eval_two_flts(curr);
+    return builtin_2c_result(flt_to_atom(other_flt+rhs_flt));
+}
+
+atom red_fsub(atom curr) __z88dk_fastcall
+{
+    double rhs_flt = eval_two_flts(curr);
+    return builtin_2c_result(flt_to_atom(other_flt-rhs_flt));
+}
+
+atom red_fmul(atom curr) __z88dk_fastcall
+{
+    double rhs_flt = eval_two_flts(curr);
+    return builtin_2c_result(flt_to_atom(other_flt*rhs_flt));
+}
+
+atom red_fdiv(atom curr) __z88dk_fastcall
+{
+    double rhs_flt = eval_two_flts(curr);
+    return builtin_2c_result(flt_to_atom(other_flt/rhs_flt));
+}
+
+atom red_feq(atom curr) __z88dk_fastcall
+{
+    double rhs_flt = eval_two_flts(curr);
+    return builtin_2c_result(LIT_TO_ATOM(other_flt==rhs_flt ? LIT_K : LIT_F));
+}
+
+atom red_flt(atom curr) __z88dk_fastcall
+{
+    double rhs_flt = eval_two_flts(curr);
+    return builtin_2c_result(LIT_TO_ATOM(other_flt < rhs_flt ? LIT_K : LIT_F));
+}
+
+atom red_itof(atom curr) __z88dk_fastcall
+{
+    atom reduced = reduce_arg(curr);
+    return builtin_1c_result(flt_to_atom(atom_to_flt(reduced)));
+}
+
+/* Truncates towards zero, and wraps like the integer operators do. */
+atom red_ftoi(atom curr) __z88dk_fastcall
+{
+    double d = atom_to_flt(reduce_arg(curr));
+    /* Converting NaN, or anything too big for a long, is undefined. */
+    if (d != d)
+	d = 0.0;
+    else if (d > 32767.0)
+	d = 32767.0;
+    else if (d < -32767.0)
+	d = -32767.0;
+    return builtin_1c_result(LIT_TO_ATOM(((literal) (long) d) & 0x7fff));
+}
+
+/*
+ * A string applied to a function behaves like the equivalent list built
+ * with $cons and $nil, handing over its first character and the rest of
+ * the string, which shares the same buffer.
+ */
+atom red_str(atom curr) __z88dk_fastcall
+{
+    struct str_box* sb = atom_to_str(rs_top_ptr[0]);
+    atom hd, tl;
+    if (sb->len == 0)
+	return replace(curr, LIT_TO_ATOM(LIT_K));
+    hd = LIT_TO_ATOM((unsigned char) sb->buf->data[sb->start]);
+    tl = str_to_atom(sb->buf, sb->start+1, sb->len-1);
+    return replace(curr, alloc_app(alloc_app(copy_atom(NODE_ARG(curr)), hd),
+				   tl));
+}
+
+atom red_slen(atom curr) __z88dk_fastcall
+{
+    atom reduced = reduce_arg(curr);
+    return builtin_1c_result(LIT_TO_ATOM(atom_to_str(reduced)->len & 0x7fff));
+}
+
+/* (((($sslice k) s) start) len), clamped to the bounds of s. */
+atom red_sslice(atom curr) __z88dk_fastcall
+{
+    struct str_box* sb = atom_to_str(reduce_arg(rs_top_ptr[1]));
+    literal start = lit_arg(2);
+    literal len = lit_arg(3);
+    if (sb->len == 0)
+	return builtin_3c_result(empty_str());
+    if (start > sb->len)
+	start = sb->len;
+    if (len > sb->len - start)
+	len = sb->len - start;
+    return builtin_3c_result(str_to_atom(sb->buf, sb->start + start, len));
+}
+
+atom red_scat(atom curr) __z88dk_fastcall
+{
+    atom lhs = reduce_arg(rs_top_ptr[1]);
+    atom rhs = reduce_arg(curr);
+    struct str_box* lsb = atom_to_str(lhs);
+    struct str_box* rsb = atom_to_str(rhs);
+    struct str_buf* buf;
+    if (rsb->len == 0)
+	return builtin_2c_result(lsb->len > 0 ? copy_atom(lhs) : empty_str());
+    if (lsb->len == 0)
+	return builtin_2c_result(copy_atom(rhs));
+    if (lsb->len + rsb->len > MAX_STR_LEN)
+	engine_error("string too long");
+    buf = alloc_str_buf(lsb->len + rsb->len);
+    memcpy(buf->data, lsb->buf->data + lsb->start, lsb->len);
+    memcpy(buf->data + lsb->len, rsb->buf->data + rsb->start, rsb->len);
+    return builtin_2c_result(str_to_atom(buf, 0, lsb->len + rsb->len));
+}
+
+/*
+ * Takes a list apart the same way the list macros do, by applying it to a
+ * function.  We use a literal that doesn't reduce, so we get back the
+ * application the function would have received.  Returns zero at the end
+ * of the list, otherwise sets *hd and *tl to new references.
+ */
+char uncons(atom list, atom* hd, atom* tl)
+{
+    atom r = reduce(alloc_app(copy_atom(list), LIT_TO_ATOM(0)));
+    char is_cons = !IS_LIT(r) && !IS_LIT(NODE_FUNC(r))
+	&& NODE_FUNC(NODE_FUNC(r)) == LIT_TO_ATOM(0);
+    if (is_cons) {
+	*hd = copy_atom(NODE_ARG(NODE_FUNC(r)));
+	*tl = copy_atom(NODE_ARG(r));
+    }
+    free_app_all(r);
+    return is_cons;
+}
+
+/* Arrays act like lists, just as strings do. */
+atom red_arr(atom curr) __z88dk_fastcall
+{
+    struct arr_box* ab = atom_to_arr(rs_top_ptr[0]);
+    atom hd, tl;
+    if (ab->len == 0)
+	return replace(curr, LIT_TO_ATOM(LIT_K));
+    hd = copy_atom(ab->buf->elems[ab->start]);
+    tl = arr_to_atom(ab->buf, ab->start+1, ab->len-1);
+    return replace(curr, alloc_app(alloc_app(copy_atom(NODE_ARG(curr)), hd),
+				   tl));
+}
+
+/*
+ * Gathers the elements of a list into a new buffer, forcing its spine but
+ * leaving the elements unevaluated.  Takes over our reference to the list.
+ */
+struct arr_buf* list_to_arr_buf(atom list) __z88dk_fastcall
+{
+    struct arr_buf* buf = alloc_arr_buf(0);
+    atom hd, tl;
+    while (uncons(list, &hd, &tl)) {
+	free_app_all(list);
+	list = tl;
+	buf = arr_buf_append(buf, hd);
+    }
+    free_app_all(list);
+    return buf;
+}
+
+atom red_afromlist(atom curr) __z88dk_fastcall
+{
+    atom list = copy_atom(NODE_ARG(curr));
+    struct arr_buf* buf;
+    if (IS_BOXED(list, LIT_ARR))
+	return builtin_1c_result(list);
+    buf = list_to_arr_buf(list);
+    return builtin_1c_result(arr_to_atom(buf, 0, buf->len));
+}
+
+/* Indexing outside the array gives zero. */
+atom red_aindex(atom curr) __z88dk_fastcall
+{
+    struct arr_box* ab = atom_to_arr(reduce_arg(rs_top_ptr[1]));
+    atom index = reduce_arg(curr);
+    if (!IS_LIT(index) || ATOM_TO_LIT(index) >= ab->len)
+	return builtin_2c_result(LIT_TO_ATOM(0));
+    return builtin_2c_result(
+	copy_atom(ab->buf->elems[ab->start + ATOM_TO_LIT(index)]));
+}
+
+atom red_alen(atom curr) __z88dk_fastcall
+{
+    atom reduced = reduce_arg(curr);
+    return builtin_1c_result(LIT_TO_ATOM(atom_to_arr(reduced)->len & 0x7fff));
+}
+
+/* (((($aslice k) a) start) len), clamped to the bounds of a. */
+atom red_aslice(atom curr) __z88dk_fastcall
+{
+    struct arr_box* ab = atom_to_arr(reduce_arg(rs_top_ptr[1]));
+    literal start = lit_arg(2);
+    literal len = lit_arg(3);
+    if (ab->len == 0)
+	return builtin_3c_result(arr_to_atom(alloc_arr_buf(0), 0, 0));
+    if (start > ab->len)
+	start = ab->len;
+    if (len > ab->len - start)
+	len = ab->len - start;
+    return builtin_3c_result(arr_to_atom(ab->buf, ab->start + start, len));
+}
+
+/*
+ * Finds the array for $aset or $amodify to update.  If nothing else can
+ * see it, it can be updated in place, otherwise we copy it first.  The
+ * refcounts tell us which: the array node must only be referenced from
+ * the spine, and the spine nodes leading to it must not be shared either,
+ * as another redex could then use the same array.  (The root of the redex
+ * can be shared, as anyone else looking at it will see our result.)
+ * Either way, the caller gets a new reference.
+ */
+atom arr_for_update(void)
+{
+    atom arr = reduce_arg(rs_top_ptr[1]);
+    struct arr_box* ab;
+    struct arr_buf* buf;
+    uint16_t i;
+    if (!IS_BOXED(arr, LIT_ARR))
+	return arr_to_atom(alloc_arr_buf(0), 0, 0);
+    ab = &BOX_OF(arr).u.arr;
+    if (NODE_REFCOUNT(arr) == 1 && ab->buf->refcount == 1
+	&& NODE_REFCOUNT(rs_top_ptr[1]) == 1
+	&& NODE_REFCOUNT(rs_top_ptr[2]) == 1)
+	return copy_atom(arr);
+    buf = alloc_arr_buf(ab->len);
+    for (i = 0; i < ab->len; ++i)
+	buf->elems[i] = copy_atom(ab->buf->elems[ab->start + i]);
+    return arr_to_atom(buf, 0, ab->len);
+}
+
+/* (((($aset k) a) i) v), where indexes outside the array change nothing. */
+atom red_aset(atom curr) __z88dk_fastcall
+{
+    atom index = reduce_arg(rs_top_ptr[2]);
+    atom arr = arr_for_update();
+    struct arr_box* ab = &BOX_OF(arr).u.arr;
+    if (IS_LIT(index) && ATOM_TO_LIT(index) < ab->len) {
+	atom* ep = &ab->buf->elems[ab->start + ATOM_TO_LIT(index)];
+	atom val = copy_atom(NODE_ARG(curr));
+	free_app_all(*ep);
+	*ep = val;
+    }
+    return builtin_3c_result(arr);
+}
+
+/* (((($amodify k) a) i) f) replaces element i, x, with (f x). */
+atom red_amodify(atom curr) __z88dk_fastcall
+{
+    atom index = reduce_arg(rs_top_ptr[2]);
+    atom arr = arr_for_update();
+    struct arr_box* ab = &BOX_OF(arr).u.arr;
+    if (IS_LIT(index) && ATOM_TO_LIT(index) < ab->len) {
+	atom* ep = &ab->buf->elems[ab->start + ATOM_TO_LIT(index)];
+	*ep = alloc_app(copy_atom(NODE_ARG(curr)), *ep);
+    }
+    return builtin_3c_result(arr);
+}
+
+/*
+ * $vmap recognises functions built from arithmetic sections, ((op I) n)
+ * computing n op x and ((C (op I)) n) computing x op n, composed with B,
+ * and runs each step over the whole array in a simple loop that the
+ * compiler can vectorise, if the elements are all literals.  Anything
+ * else is mapped lazily, element by element.
+ */
+
+#define MAX_VSTEPS 8
+
+struct vstep {
+    literal op;
+    literal n;
+    char flip;
+};
+
+struct vprog {
+    uint8_t len;
+    struct vstep steps[MAX_VSTEPS];
+};
+
+/* Appends the steps for fn, returning zero if it isn't recognised. */
+char compile_vsteps(struct vprog* prog, atom fn)
+{
+    struct vstep* step;
+    atom inner, op;
+    char flip = 0;
+    if (fn == LIT_TO_ATOM(LIT_I))
+	return 1;
+    if (IS_LIT(fn))
+	return 0;
+    inner = NODE_FUNC(fn);
+    if (IS_LIT(inner))
+	return 0;
+    if (NODE_FUNC(inner) == LIT_TO_ATOM(LIT_B))
+	return compile_vsteps(prog, NODE_ARG(fn))
+	    && compile_vsteps(prog, NODE_ARG(inner));
+    if (NODE_FUNC(inner) == LIT_TO_ATOM(LIT_C)) {
+	inner = NODE_ARG(inner);
+	if (IS_LIT(inner))
+	    return 0;
+	flip = 1;
+    }
+    op = NODE_FUNC(inner);
+    if (NODE_ARG(inner) != LIT_TO_ATOM(LIT_I) || !IS_LIT(NODE_ARG(fn))
+	|| prog->len == MAX_VSTEPS)
+	return 0;
+    switch (ATOM_TO_LIT(op)) {
+    case LIT_pl: case LIT_mi: case LIT_tm: case LIT_dv: case LIT_eq: case LIT_lt:
+	break;
+    default:
+	return 0;
+    }
+    step = &prog->steps[prog->len];
+    step->op = ATOM_TO_LIT(op);
+    step->n = ATOM_TO_LIT(NODE_ARG(fn));
+    step->flip = flip;
+    if (flip && step->op == LIT_dv && step->n == 0)
+	return 0;
+    ++prog->len;
+    return 1;
+}
+
+/* Runs one step over the elements, returning zero on division by zero. */
+char run_vstep(atom* elems, uint16_t len, struct vstep* step)
+{
+    literal n = step->n;
+    uint16_t i;
+    switch (step->op) {
+    case LIT_pl:
+	for (i = 0; i < len; ++i)
+	    elems[i] = LIT_TO_ATOM((ATOM_TO_LIT(elems[i]) + n) & 0x7fff);
+	break;
+    case LIT_mi:
+	if (step->flip)
+	    for (i = 0; i < len; ++i)
+		elems[i] = LIT_TO_ATOM((ATOM_TO_LIT(elems[i]) - n) & 0x7fff);
+	else
+	    for (i = 0; i < len; ++i)
+		elems[i] = LIT_TO_ATOM((n - ATOM_TO_LIT(elems[i])) & 0x7fff);
+	break;
+    case LIT_tm:
+	for (i = 0; i < len; ++i)
+	    elems[i] = LIT_TO_ATOM((ATOM_TO_LIT(elems[i]) * n) & 0x7fff);
+	break;
+    case LIT_dv:
+	if (step->flip) {
+	    for (i = 0; i < len; ++i)
+		elems[i] = LIT_TO_ATOM((ATOM_TO_LIT(elems[i]) / n) & 0x7fff);
+	    break;
+	}
+	for (i = 0; i < len; ++i)
+	    if (ATOM_TO_LIT(elems[i]) == 0)
+		return 0;
+	for (i = 0; i < len; ++i)
+	    elems[i] = LIT_TO_ATOM((n / ATOM_TO_LIT(elems[i])) & 0x7fff);
+	break;
+    case LIT_eq:
+	for (i = 0; i < len; ++i)
+	    elems[i] = LIT_TO_ATOM(ATOM_TO_LIT(elems[i]) == n ? LIT_K : LIT_F);
+	break;
+    case LIT_lt:
+	if (step->flip)
+	    for (i = 0; i < len; ++i)
+		elems[i] = LIT_TO_ATOM(ATOM_TO_LIT(elems[i]) < n ? LIT_K : LIT_F);
+	else
+	    for (i = 0; i < len; ++i)
+		elems[i] = LIT_TO_ATOM(n < ATOM_TO_LIT(elems[i]) ? LIT_K : LIT_F);
+	break;
+    }
+    return 1;
+}
+
+char run_vprog(struct vprog* prog, atom* elems, uint16_t len)
+{
+    uint8_t i;
+    for (i = 0; i < prog->len; ++i)
+	if (!run_vstep(elems, len, &prog->steps[i]))
+	    return 0;
+    return 1;
+}
+
+/* ((($vmap k) f) a) */
+atom red_vmap(atom curr) __z88dk_fastcall
+{
+    struct arr_box* ab = atom_to_arr(reduce_arg(curr));
+    struct arr_buf* buf = alloc_arr_buf(ab->len);
+    atom* src = ab->buf ? &ab->buf->elems[ab->start] : NULL;
+    struct vprog prog;
+    atom fn;
+    uint16_t i;
+    if (ab->len == 0)
+	return builtin_2c_result(arr_to_atom(buf, 0, 0));
+    fn = reduce_arg(rs_top_ptr[1]);
+    prog.len = 0;
+    if (compile_vsteps(&prog, fn) && prog.len > 0) {
+	/*
+	 * Only if the elements are already literals, as evaluating them now
+	 * could fail or never finish, even if they're never needed.
+	 */
+	for (i = 0; i < ab->len && IS_LIT(src[i]); ++i)
+	    buf->elems[i] = src[i];
+	if (i == ab->len && run_vprog(&prog, buf->elems, ab->len))
+	    return builtin_2c_result(arr_to_atom(buf, 0, ab->len));
+    }
+    for (i = 0; i < ab->len; ++i)
+	buf->elems[i] = alloc_app(copy_atom(fn), copy_atom(src[i]));
+    return builtin_2c_result(arr_to_atom(buf, 0, ab->len));
+}
+
+/*
+ * (((NUM n) f) x) applies f to x n times.  When f is also a numeral, the
+ * result is a numeral for the power, when it's a numeral applied to g,
+ * the product applied to g, when it's $succ the sum, and when
+ * it's an arithmetic section (as understood by $vmap) and x is a literal,
+ * the answer is computed directly.  Otherwise we peel off one
+ * application of f, leaving (((NUM n-1) f) x) for later.
+ */
+atom red_num(atom curr) __z88dk_fastcall
+{
+    literal n = ATOM_TO_LIT(NODE_ARG(rs_top_ptr[0]));
+    struct vprog prog;
+    atom fn, x;
+    if (n == 0 || !IS_NUM(rs_top_ptr[0]))
+	return replace(curr, copy_atom(NODE_ARG(curr)));
+    fn = reduce_arg(rs_top_ptr[1]);
+    if (IS_NUM(fn)) {
+	unsigned long power = 1;
+	literal i;
+	for (i = 0; i < n && power <= 0x7fff; ++i)
+	    power *= NUM_VALUE(fn);
+	if (power <= 0x7fff)
+	    return replace(curr, alloc_app(num_to_atom(power),
+					   copy_atom(NODE_ARG(curr))));
+    } else if (!IS_LIT(fn) && IS_NUM(NODE_FUNC(fn))) {
+	unsigned long product = (unsigned long) n * NUM_VALUE(NODE_FUNC(fn));
+	if (product <= 0x7fff)
+	    return replace(curr,
+			   alloc_app(alloc_app(num_to_atom(product),
+					       copy_atom(NODE_ARG(fn))),
+				     copy_atom(NODE_ARG(curr))));
+    } else if (fn == LIT_TO_ATOM(LIT_nsucc)) {
+	x = reduce_arg(curr);
+	if (IS_NUM(x) && NUM_VALUE(x) <= 0x7fff - n)
+	    return replace(curr, num_to_atom(NUM_VALUE(x) + n));
+    } else {
+	prog.len = 0;
+	if (compile_vsteps(&prog, fn) && prog.len > 0) {
+	    literal i;
+	    x = reduce_arg(curr);
+	    for (i = 0; i < n && IS_LIT(x); ++i)
+		if (!run_vprog(&prog, &x, 1))
+		    break;
+	    if (i == n)
+		return replace(curr, x);
+	}
+    }
+    return replace(curr,
+		   alloc_app(copy_atom(fn),
+			     alloc_app(alloc_app(num_to_atom(n - 1),
+						 copy_atom(fn)),
+				       copy_atom(NODE_ARG(curr)))));
+}
+
+/*
+ * The numeric macros work on native numerals directly, and fall back to
+ * their Church-numeral definitions for anything else (or when the result
+ * would be too big to be a native numeral).
+ */
+
+const char* numeral_defs[] = {
+    "@SB",
+    "@@C@@BC@@B@BC@@C@@BC@@B@BB@@CB@@B@BJJKI",
+    "@@C@J@KFK",
+    "@@BS@BB",
+    "@@C@@BB@@C@J@J@@BJ@SB@JF@@B@S@@C@J@@B@C@@BBS@@B@S@@BBB@@B@BCC@KF@@C@@BB@J@@C@JKI@@C@J@@BKJK",
+    "B",
+    "@@C@@BC@@C@@BC@@C@@BB@J@@C@J@@@SII@@BK@@BJ@@SIII@@C@J@@BKJKK@KF",
+    "@@C@@C@J@@B@SB@@CB@SBFI"
+};
+
+/* Replaces a native macro's redex with its combinator definition. */
+atom macro_fallback(const char* def, uint8_t nargs)
+{
+    atom result = string_to_atom(def);
+    uint8_t i;
+    for (i = 0; i < nargs; ++i)
+	result = alloc_app(result, copy_atom(NODE_ARG(rs_top_ptr[i])));
+    return replace(rs_top_ptr[nargs-1], result);
+}
+
+atom numeral_fallback(literal op, uint8_t nargs)
+{
+    return macro_fallback(numeral_defs[LIT_SUBTYPE(op) - LIT_SUBTYPE(LIT_nsucc)],
+			  nargs);
+}
+
+/* Reduces the argument of app, and gets its value if it's a numeral. */
+char num_arg(atom app, literal* np)
+{
+    atom a = reduce_arg(app);
+    if (!IS_NUM(a))
+	return 0;
+    *np = NUM_VALUE(a);
+    return 1;
+}
+
+atom red_nsucc(atom curr) __z88dk_fastcall
+{
+    literal n;
+    if (num_arg(curr, &n) && n < 0x7fff)
+	return replace(curr, num_to_atom(n + 1));
+    return numeral_fallback(LIT_nsucc, 1);
+}
+
+atom red_npred(atom curr) __z88dk_fastcall
+{
+    literal n;
+    if (num_arg(curr, &n))
+	return replace(curr, num_to_atom(n == 0 ? 0 : n - 1));
+    return numeral_fallback(LIT_npred, 1);
+}
+
+atom red_niszero(atom curr) __z88dk_fastcall
+{
+    literal n;
+    if (num_arg(curr, &n))
+	return replace(curr, LIT_TO_ATOM(n == 0 ? LIT_K : LIT_F));
+    return numeral_fallback(LIT_niszero, 1);
+}
+
+atom red_nplus(atom curr) __z88dk_fastcall
+{
+    literal m, n;
+    if (num_arg(rs_top_ptr[0], &m) && num_arg(curr, &n) && n <= 0x7fff - m)
+	return replace(curr, num_to_atom(m + n));
+    return numeral_fallback(LIT_nplus, 2);
+}
+
+atom red_nsub(atom curr) __z88dk_fastcall
+{
+    literal m, n;
+    if (num_arg(rs_top_ptr[0], &m) && num_arg(curr, &n))
+	return replace(curr, num_to_atom(m > n ? m - n : 0));
+    return numeral_fallback(LIT_nsub, 2);
+}
+
+atom red_ntimes(atom curr) __z88dk_fastcall
+{
+    literal m, n;
+    if (num_arg(rs_top_ptr[0], &m) && num_arg(curr, &n)
+	&& (unsigned long) m * n <= 0x7fff)
+	return replace(curr, num_to_atom(m * n));
+    return numeral_fallback(LIT_ntimes, 2);
+}
+
+atom red_neq(atom curr) __z88dk_fastcall
+{
+    literal m, n;
+    if (num_arg(rs_top_ptr[0], &m) && num_arg(curr, &n))
+	return replace(curr, LIT_TO_ATOM(m == n ? LIT_K : LIT_F));
+    return numeral_fallback(LIT_neq, 2);
+}
+
+atom red_nfact(atom curr) __z88dk_fastcall
+{
+    literal n;
+    if (num_arg(curr, &n)) {
+	unsigned long fact = 1;
+	for (; n > 1 && fact <= 0x7fff; --n)
+	    fact *= n;
+	if (fact <= 0x7fff)
+	    return replace(curr, num_to_atom(fact));
+    }
+    return numeral_fallback(LIT_nfact, 1);
+}
+
+/* (($ntoi k) n) passes the literal for numeral n to k. */
+atom red_ntoi(atom curr) __z88dk_fastcall
+{
+    literal n;
+    atom result;
+    if (num_arg(curr, &n))
+	return builtin_1c_result(LIT_TO_ATOM(n));
+    /* Count in continuation-passing style, as ((C +) 1), to save space. */
+    result = alloc_app(alloc_app(LIT_TO_ATOM(LIT_C), LIT_TO_ATOM(LIT_pl)),
+		       LIT_TO_ATOM(1));
+    result = alloc_app(alloc_app(copy_atom(NODE_ARG(curr)), result),
+		       LIT_TO_ATOM(LIT_I));
+    result = reduce(alloc_app(result, LIT_TO_ATOM(0)));
+    if (!IS_LIT(result)) {
+	free_app_all(result);
+	result = LIT_TO_ATOM(0);
+    }
+    return builtin_1c_result(result);
+}
+
+/* (($iton k) i) passes the numeral for literal i to k. */
+atom red_iton(atom curr) __z88dk_fastcall
+{
+    return builtin_1c_result(num_to_atom(lit_arg(1)));
+}
+
+/*
+ * ((($pair a) b) z) gives ((z a) b), just like ((((B C) J) a) b) would,
+ * but in one step, and taking pairs and cons cells apart with $fst/$hd
+ * (z = K) or $snd/$tl (z = F) doesn't even need to build (z a).
+ */
+atom red_pair(atom curr) __z88dk_fastcall
+{
+    atom z = NODE_ARG(curr);
+    atom a = NODE_ARG(rs_top_ptr[0]);
+    atom b = NODE_ARG(rs_top_ptr[1]);
+    if (z == LIT_TO_ATOM(LIT_K))
+	return replace(curr, copy_atom(a));
+    if (z == LIT_TO_ATOM(LIT_F))
+	return replace(curr, copy_atom(b));
+    return replace(curr, alloc_app(alloc_app(copy_atom(z), copy_atom(a)),
+				   copy_atom(b)));
+}
+
+/*
+ * ((($case l) n) c) gives ((c h) t) if l is a cons cell, and n if it's
+ * $nil.  Other lists, such as strings, use the combinator definition.
+ */
+atom red_case(atom curr) __z88dk_fastcall
+{
+    atom list = reduce_arg(rs_top_ptr[0]);
+    if (!IS_LIT(list) && !IS_LIT(NODE_FUNC(list))
+	&& NODE_FUNC(NODE_FUNC(list)) == LIT_TO_ATOM(LIT_pair))
+	return replace(curr,
+		       alloc_app(alloc_app(copy_atom(NODE_ARG(curr)),
+					   copy_atom(NODE_ARG(NODE_FUNC(list)))),
+				 copy_atom(NODE_ARG(list))));
+    if (!IS_LIT(list) && NODE_FUNC(list) == LIT_TO_ATOM(LIT_K)
+	&& NODE_ARG(list) == LIT_TO_ATOM(LIT_K))
+	return replace(curr, copy_atom(NODE_ARG(rs_top_ptr[1])));
+    return macro_fallback("@@C@@BC@@B@BC@@BC@@CB@@B@B@BK@B@BKI", 3);
+}
+
+/* (($seq a) b) evaluates a (as far as its head) and gives b. */
+atom red_seq(atom curr) __z88dk_fastcall
+{
+    reduce_arg(rs_top_ptr[0]);
+    return replace(curr, copy_atom(NODE_ARG(curr)));
+}
+
+/*
+ * (($deepseq a) b) evaluates all of a, and gives b.  Rather than
+ * recursing, it keeps a stack of the places still to be evaluated, so
+ * long lists don't run us out of C stack.  Once a place has been
+ * evaluated, its arguments, array elements, or map values are pushed
+ * in turn.
+ */
+
+struct slot_stack {
+    atom** slots;
+    size_t len, size;
+};
+
+void push_slot(struct slot_stack* stack, atom* slot)
+{
+    if (stack->len == stack->size) {
+	stack->size *= 2;
+	stack->slots =
+	    realloc_mem(stack->slots, stack->size * sizeof(atom*));
+    }
+    stack->slots[stack->len++] = slot;
+}
+
+void push_map_slots(struct slot_stack* stack, struct map_node* n)
+{
+    uint8_t i;
+    for (i = 0; n != NULL && i < n->count; ++i) {
+	if (n->entries[i].child)
+	    push_map_slots(stack, n->entries[i].child);
+	else
+	    push_slot(stack, &n->entries[i].value);
+    }
+}
+
+void deep_reduce(atom* slot) __z88dk_fastcall
+{
+    struct slot_stack stack;
+    stack.size = 16;
+    stack.len = 0;
+    stack.slots = alloc_mem(stack.size * sizeof(atom*));
+    push_slot(&stack, slot);
+    while (stack.len > 0) {
+	atom* slot = stack.slots[--stack.len];
+	atom a = *slot = reduce(*slot);
+	if (IS_BOXED(a, LIT_ARR)) {
+	    struct arr_box* ab = &BOX_OF(a).u.arr;
+	    uint16_t i;
+	    for (i = 0; i < ab->len; ++i)
+		push_slot(&stack, &ab->buf->elems[ab->start + i]);
+	} else if (IS_BOXED(a, LIT_MAP)) {
+	    push_map_slots(&stack, BOX_OF(a).u.map.root);
+	} else {
+	    for (; !IS_LIT(a); a = NODE_FUNC(a))
+		push_slot(&stack, &NODE_ARG(a));
+	}
+    }
+    free_mem(stack.slots);
+}
+
+atom red_deepseq(atom curr) __z88dk_fastcall
+{
+    deep_reduce(&NODE_ARG(rs_top_ptr[0]));
+    return replace(curr, copy_atom(NODE_ARG(curr)));
+}
+
+/*
+ * (($par x) y) gives y, but with USE_POSIX, x first becomes a spark, so
+ * that a worker process can evaluate it (as far as its head) in the
+ * meantime.
+ */
+#ifdef USE_POSIX
+void make_spark(atom x) __z88dk_fastcall;
+#endif
+
+atom red_par(atom curr) __z88dk_fastcall
+{
+#ifdef USE_POSIX
+    make_spark(NODE_ARG(rs_top_ptr[0]));
+#endif
+    return replace(curr, copy_atom(NODE_ARG(curr)));
+}
+
+#ifdef USE_POSIX
+/*
+ * Results come back from workers as a series of records, children first,
+ * so that sharing is kept: an 'a' record is an app node, with two
+ * references, and 'f', 's', 'r' and 'm' records are floats, strings,
+ * arrays and maps.  A reference is a literal, or 0x8000 plus the number of
+ * an earlier record.  The last record, 'e', refers to the root, and says
+ * how many reductions the worker did.
+ * Indirections are skipped, and sparks are sent as their thunks.
+ */
+
+atom resolve_ref(atom a) __z88dk_fastcall
+{
+    while (!IS_LIT(a)) {
+	if (NODE_FUNC(a) == LIT_TO_ATOM(LIT_I))
+	    a = NODE_ARG(a);
+	else if (IS_BOXED(a, LIT_SPARK))
+	    a = BOX_OF(a).u.spark.thunk;
+	else
+	    break;
+    }
+    return a;
+}
+
+#define NOT_SENT 0xffff
+
+/* Pushes a slot if it refers to a node not yet sent. */
+char push_unsent(struct slot_stack* stack, uint16_t* ids, atom* slot)
+{
+    atom a = resolve_ref(*slot);
+    if (IS_LIT(a) || ids[ATOM_TO_INDEX(a)] != NOT_SENT)
+	return 0;
+    push_slot(stack, slot);
+    return 1;
+}
+
+char push_unsent_map(struct slot_stack* stack, uint16_t* ids,
+		     struct map_node* n)
+{
+    char pushed = 0;
+    uint8_t i;
+    for (i = 0; n != NULL && i < n->count; ++i) {
+	if (n->entries[i].child)
+	    pushed |= push_unsent_map(stack, ids, n->entries[i].child);
+	else
+	    pushed |= push_unsent(stack, ids, &n->entries[i].value);
+    }
+    return pushed;
+}
+
+void put_ref(FILE* out, uint16_t* ids, atom a)
+{
+    uint16_t ref;
+    a = resolve_ref(a);
+    ref = IS_LIT(a) ? ATOM_TO_LIT(a) : 0x8000 | ids[ATOM_TO_INDEX(a)];
+    fwrite(&ref, sizeof(ref), 1, out);
+}
+
+void put_map_entries(FILE* out, uint16_t* ids, struct map_node* n)
+{
+    uint8_t i;
+    for (i = 0; n != NULL && i < n->count; ++i) {
+	struct map_entry* e = &n->entries[i];
+	if (e->child) {
+	    put_map_entries(out, ids, e->child);
+	} else {
+	    fwrite(&e->key, sizeof(e->key), 1, out);
+	    put_ref(out, ids, e->value);
+	}
+    }
+}
+
+void put_node(FILE* out, uint16_t* ids, atom a)
+{
+    struct box* b = IS_BOX(a) ? &BOX_OF(a) : NULL;
+    uint16_t i;
+    switch (b != NULL ? ATOM_TO_LIT(NODE_FUNC(a)) : 0) {
+    case LIT_FLT:
+	putc('f', out);
+	fwrite(&b->u.flt, sizeof(double), 1, out);
+	break;
+    case LIT_STR:
+	putc('s', out);
+	fwrite(&b->u.str.len, sizeof(uint16_t), 1, out);
+	fwrite(b->u.str.buf->data + b->u.str.start, 1, b->u.str.len, out);
+	break;
+    case LIT_ARR:
+	putc('r', out);
+	fwrite(&b->u.arr.len, sizeof(uint16_t), 1, out);
+	for (i = 0; i < b->u.arr.len; ++i)
+	    put_ref(out, ids, b->u.arr.buf->elems[b->u.arr.start + i]);
+	break;
+    case LIT_MAP:
+	putc('m', out);
+	fwrite(&b->u.map.size, sizeof(uint16_t), 1, out);
+	put_map_entries(out, ids, b->u.map.root);
+	break;
+    default:
+	putc('a', out);
+	put_ref(out, ids, NODE_FUNC(a));
+	put_ref(out, ids, NODE_ARG(a));
+    }
+}
+
+void send_graph(FILE* out, atom root)
+{
+    uint16_t* ids = alloc_mem(MAX_APPS * sizeof(uint16_t));
+    uint16_t next_id = 0;
+    struct slot_stack stack;
+    memset(ids, 0xff, MAX_APPS * sizeof(uint16_t));
+    stack.size = 16;
+    stack.len = 0;
+    stack.slots = alloc_mem(stack.size * sizeof(atom*));
+    push_unsent(&stack, ids, &root);
+    while (stack.len > 0) {
+	atom a = resolve_ref(*stack.slots[stack.len-1]);
+	char pushed;
+	if (ids[ATOM_TO_INDEX(a)] != NOT_SENT) {
+	    --stack.len;
+	    continue;
+	}
+	if (IS_BOXED(a, LIT_ARR)) {
+	    struct arr_box* ab = &BOX_OF(a).u.arr;
+	    uint16_t i;
+	    pushed = 0;
+	    for (i = 0; i < ab->len; ++i)
+		pushed |= push_unsent(&stack, ids,
+				      &ab->buf->elems[ab->start + i]);
+	} else if (IS_BOXED(a, LIT_MAP)) {
+	    pushed = push_unsent_map(&stack, ids, BOX_OF(a).u.map.root);
+	} else if (IS_BOXED(a, LIT_FLT) || IS_BOXED(a, LIT_STR)) {
+	    pushed = 0;
+	} else {
+	    pushed = push_unsent(&stack, ids, &NODE_FUNC(a));
+	    pushed |= push_unsent(&stack, ids, &NODE_ARG(a));
+	}
+	if (!pushed) {
+	    put_node(out, ids, a);
+	    ids[ATOM_TO_INDEX(a)] = next_id++;
+	    --stack.len;
+	}
+    }
+    putc('e', out);
+    put_ref(out, ids, root);
+    fwrite(&reductions, sizeof(reductions), 1, out);
+    free_mem(stack.slots);
+    free_mem(ids);
+}
+
+/*
+ * Gives NOT_REDUCED if the worker didn't send a whole graph.  Each
+ * received node is held in nodes until the end, so references to it can
+ * be copied.
+ */
+atom get_ref(FILE* in, atom* nodes, uint16_t num_nodes)
+{
+    uint16_t ref = 0;
+    if (fread(&ref, sizeof(ref), 1, in) != 1)
+	return LIT_TO_ATOM(0);
+    if (!(ref & 0x8000))
+	return LIT_TO_ATOM(ref);
+    ref &= 0x7fff;
+    return ref < num_nodes ? copy_atom(nodes[ref]) : LIT_TO_ATOM(0);
+}
+
+atom receive_graph(FILE* in)
+{
+    atom* nodes = alloc_mem(MAX_APPS * sizeof(atom));
+    uint16_t n = 0, len, i;
+    atom result = NOT_REDUCED;
+    int kind;
+    while (result == NOT_REDUCED && n < MAX_APPS
+	   && (kind = getc(in)) != EOF) {
+	switch (kind) {
+	case 'a': {
+	    atom func = get_ref(in, nodes, n);
+	    atom arg = get_ref(in, nodes, n);
+	    nodes[n++] = alloc_app(func, arg);
+	    break;
+	}
+	case 'f': {
+	    double d = 0.0;
+	    if (fread(&d, sizeof(d), 1, in) != 1)
+		goto done;
+	    nodes[n++] = flt_to_atom(d);
+	    break;
+	}
+	case 's': {
+	    struct str_buf* buf;
+	    if (fread(&len, sizeof(len), 1, in) != 1)
+		goto done;
+	    buf = alloc_str_buf(len);
+	    if (fread(buf->data, 1, len, in) != len) {
+		free_mem(buf);
+		goto done;
+	    }
+	    nodes[n++] = str_to_atom(buf, 0, len);
+	    break;
+	}
+	case 'r': {
+	    struct arr_buf* buf;
+	    if (fread(&len, sizeof(len), 1, in) != 1)
+		goto done;
+	    buf = alloc_arr_buf(len);
+	    for (i = 0; i < len; ++i)
+		buf->elems[i] = get_ref(in, nodes, n);
+	    nodes[n++] = arr_to_atom(buf, 0, len);
+	    break;
+	}
+	case 'm': {
+	    struct map_node* root = NULL;
+	    if (fread(&len, sizeof(len), 1, in) != 1)
+		goto done;
+	    for (i = 0; i < len; ++i) {
+		struct map_node* new_root;
+		literal key = 0;
+		char added;
+		if (fread(&key, sizeof(key), 1, in) != 1) {
+		    free_map_node(root);
+		    goto done;
+		}
+		new_root = map_insert(root, key, get_ref(in, nodes, n), 0,
+				      &added);
+		free_map_node(root);
+		root = new_root;
+	    }
+	    nodes[n++] = map_to_atom(root, len);
+	    break;
+	}
+	case 'e': {
+	    unsigned int count;
+	    result = get_ref(in, nodes, n);
+	    if (fread(&count, sizeof(count), 1, in) != 1) {
+		free_app_all(result);
+		result = NOT_REDUCED;
+	    } else {
+		reductions += count;
+	    }
+	    break;
+	}
+	default:
+	    goto done;
+	}
+	/* get_ref gives 0 for a short read, which leaves in at its end. */
+	if (feof(in) || ferror(in)) {
+	    if (result != NOT_REDUCED)
+		free_app_all(result);
+	    result = NOT_REDUCED;
+	}
+    }
+done:
+    while (n > 0)
+	free_app_all(nodes[--n]);
+    free_mem(nodes);
+    return result;
+}
+
+/*
+ * Sparks wait in a pool, oldest first, until there's a spare process for
+ * them.  Whenever a worker finishes, the oldest spark is started.  If a
+ * spark is needed before its worker has finished, we wait for it (the
+ * spark is converted), unless it hasn't been started, or the worker gives
+ * up, in which case we evaluate it ourselves (the spark fizzles).  Sparks
+ * that are never needed are discarded, stopping their workers.
+ *
+ * With -s, speculate also makes sparks, of the (g x) made by S, which are
+ * started straight away, if there's a spare process, or not at all.  Their
+ * workers give up after a budget of reductions.
+ */
+
+#define MAX_SPARKS 256
+
+#ifndef SPECULATE_GRAIN
+#define SPECULATE_GRAIN 5000
+#endif
+
+atom spark_pool[MAX_SPARKS];
+atom running_sparks[MAX_SPARKS];
+uint16_t num_pending = 0, num_running = 0;
+unsigned int speculate_budget = 0;
+
+/* Counted separately for sparks from $par and from speculation. */
+struct spark_counts {
+    unsigned int created, converted, fizzled, discarded;
+} spark_counts[2];
+
+/* Removes a spark from a list, if it's there. */
+uint16_t remove_spark(atom* list, uint16_t len, atom x)
+{
+    uint16_t i;
+    for (i = 0; i < len; ++i) {
+	if (list[i] == x) {
+	    memmove(&list[i], &list[i+1], (len-i-1) * sizeof(atom));
+	    return len-1;
+	}
+    }
+    return len;
+}
+
+void forget_sparks(void)
+{
+    while (num_running > 0) {
+	struct spark_box* sb = &BOX_OF(running_sparks[--num_running]).u.spark;
+	close(sb->fd);
+	sb->pid = 0;
+    }
+    num_pending = 0;
+    memset(spark_counts, 0, sizeof(spark_counts));
+}
+
+void start_spark(atom x) __z88dk_fastcall
+{
+    struct spark_box* sb = &BOX_OF(x).u.spark;
+    uint8_t share = (spare_workers - 1) / 2;
+    int fds[2];
+    if (pipe(fds) != 0)
+	return;
+    fflush(stdout);
+    sb->pid = fork();
+    if (sb->pid == 0) {
+	FILE* out;
+	close(fds[0]);
+	budget_at = sb->speculative ? speculate_budget : (unsigned int) -1;
+	start_worker(fds[1], share);
+	out = fdopen(fds[1], "wb");
+	if (out != NULL) {
+	    send_graph(out, reduce(copy_atom(sb->thunk)));
+	    fclose(out);
+	}
+	_exit(0);
+    }
+    close(fds[1]);
+    if (sb->pid < 0) {
+	sb->pid = 0;
+	close(fds[0]);
+	return;
+    }
+    sb->fd = fds[0];
+    sb->share = share;
+    spare_workers -= share + 1;
+    running_sparks[num_running++] = x;
+}
+
+void run_sparks(void)
+{
+    while (spare_workers > 0 && num_pending > 0 && USES_WORKERS) {
+	atom x = spark_pool[0];
+	num_pending = remove_spark(spark_pool, num_pending, x);
+	start_spark(x);
+    }
+}
+
+/* Stops the worker, if any, and gives back its process. */
+void stop_spark(atom x) __z88dk_fastcall
+{
+    struct spark_box* sb = &BOX_OF(x).u.spark;
+    if (sb->pid != 0) {
+	kill(sb->pid, SIGKILL);
+	close(sb->fd);
+	waitpid(sb->pid, NULL, 0);
+	sb->pid = 0;
+	spare_workers += sb->share + 1;
+	num_running = remove_spark(running_sparks, num_running, x);
+    } else {
+	num_pending = remove_spark(spark_pool, num_pending, x);
+    }
+}
+
+/* Anything already in head normal form is left alone. */
+char in_whnf(atom a) __z88dk_fastcall
+{
+    uint8_t args = 0;
+    for (; !IS_LIT(a); a = NODE_FUNC(a))
+	if (++args == 0x7f)
+	    return 0;
+    return LIT_REQARGS(ATOM_TO_LIT(a)) > args;
+}
+
+/*
+ * The spark takes over x's node, so everything that refers to x sees it,
+ * and x's contents move to a new node, the spark's thunk.
+ */
+void box_spark(atom x, uint8_t speculative)
+{
+    atom thunk = alloc_box(LIT_SPARK);
+    struct spark_box* sb;
+    atom func = NODE_FUNC(x);
+    atom arg = NODE_ARG(x);
+    NODE_FUNC(x) = NODE_FUNC(thunk);
+    NODE_ARG(x) = NODE_ARG(thunk);
+    NODE_FUNC(thunk) = func;
+    NODE_ARG(thunk) = arg;
+    BOX_OF(x).owner = x;
+    sb = &BOX_OF(x).u.spark;
+    sb->thunk = thunk;
+    sb->pid = 0;
+    sb->speculative = speculative;
+    ++spark_counts[speculative].created;
+}
+
+void make_spark(atom x) __z88dk_fastcall
+{
+    if (in_whnf(x) || IS_BOXED(x, LIT_SPARK)
+	|| num_pending == MAX_SPARKS || num_running == MAX_SPARKS
+	|| (spare_workers == 0 && num_running == 0) || !USES_WORKERS)
+	return;
+    box_spark(x, 0);
+    spark_pool[num_pending++] = x;
+    run_sparks();
+}
+
+/*
+ * Called by red_fusion, at most once every SPECULATE_GRAIN reductions, as
+ * starting a worker costs thousands of reductions.
+ */
+void speculate(atom x) __z88dk_fastcall
+{
+    speculate_at = reductions + SPECULATE_GRAIN;
+    if (spare_workers == 0 || !USES_WORKERS || num_running == MAX_SPARKS
+	|| in_whnf(x))
+	return;
+    box_spark(x, 1);
+    start_spark(x);
+}
+
+/*
+ * ($SPARK n) is reduced when the spark is needed.  One that was just
+ * written that way acts like I, as it does without USE_POSIX.
+ */
+atom red_spark(atom curr) __z88dk_fastcall
+{
+    struct spark_box* sb;
+    atom result = NOT_REDUCED;
+    if (!IS_BOXED(curr, LIT_SPARK))
+	return red_ident(curr);
+    sb = &BOX_OF(curr).u.spark;
+    if (sb->pid != 0) {
+	FILE* in = fdopen(sb->fd, "rb");
+	if (in != NULL) {
+	    result = receive_graph(in);
+	    fclose(in);
+	} else {
+	    close(sb->fd);
+	}
+	waitpid(sb->pid, NULL, 0);
+	sb->pid = 0;
+	spare_workers += sb->share + 1;
+	num_running = remove_spark(running_sparks, num_running, curr);
+    } else {
+	num_pending = remove_spark(spark_pool, num_pending, curr);
+    }
+    if (result == NOT_REDUCED) {
+	++spark_counts[sb->speculative].fizzled;
+	result = sb->thunk;
+    } else {
+	++spark_counts[sb->speculative].converted;
+	free_app_all(sb->thunk);
+    }
+    /* The node stops being a spark, and is replaced by the result. */
+    sb->thunk = LIT_TO_ATOM(LIT_I);
+    free_box(curr);
+    NODE_FUNC(curr) = LIT_TO_ATOM(LIT_I);
+    NODE_ARG(curr) = LIT_TO_ATOM(LIT_I);
+    run_sparks();
+    return replace(curr, result);
+}
+
+void free_spark(atom a) __z88dk_fastcall
+{
+    struct spark_box* sb = &BOX_OF(a).u.spark;
+    if (IS_LIT(sb->thunk))
+	return;
+    stop_spark(a);
+    ++spark_counts[sb->speculative].discarded;
+    free_app_all(sb->thunk);
+}
+
+/*
+ * A speculation is a hit if it's converted, and a miss if it's discarded
+ * (or fizzles, having run out of budget or not been started).
+ */
+void print_spark_stats(void)
+{
+    struct spark_counts* c = &spark_counts[0];
+    if (c->created > 0)
+	printf("%u sparks: %u converted, %u fizzled, %u discarded\n",
+	       c->created, c->converted, c->fizzled, c->discarded);
+    c = &spark_counts[1];
+    if (c->created > 0)
+	printf("%u speculations: %u hits (%u%%), %u fizzled, %u discarded\n",
+	       c->created, c->converted,
+	       (unsigned int) (100UL * c->converted / c->created),
+	       c->fizzled, c->discarded);
+    memset(spark_counts, 0, sizeof(spark_counts));
+}
+
+/*
+ * Once a term has been abandoned, stops the workers (and sparks) for it,
+ * and gives back their processes.
+ */
+void reset_workers(uint8_t workers) __z88dk_fastcall
+{
+    stop_workers();
+    num_sites = next_site = 0;
+    while (num_running > 0)
+	stop_spark(running_sparks[num_running-1]);
+    num_pending = 0;
+    spare_workers = workers;
+    budget_at = (unsigned int) -1;
+    memset(spark_counts, 0, sizeof(spark_counts));
+    update_fork_check();
+}
+
+/*
+ * Batch evaluation.
+ *
+ * With -b file, each line of the file is a term (see eval_line), and each
+ * term is evaluated by a process of its own, which starts with a fresh
+ * heap, so nothing that goes wrong can spoil later terms.  With -j n, up
+ * to n terms are evaluated at once, rather than using workers within a
+ * term.  The results come back through pipes, and are printed in the
+ * order of the terms, one per line.  While waiting for an earlier result,
+ * up to BATCH_WINDOW finished results per process are held on to here.
+ */
+
+#ifndef BATCH_WINDOW
+#define BATCH_WINDOW 4
+#endif
+
+struct batch_slot {
+    pid_t pid;		/* or 0 once it's finished */
+    int fd;
+    int status;
+    char* out;
+    size_t len;
+    size_t size;
+};
+
+int no_get(void* io)
+{
+    (void) io;
+    return -1;
+}
+
+int no_put(int c, void* io)
+{
+    (void) io;
+    return c;
+}
+
+/*
+ * Evaluates a line of a batch, or a request to the server: a term,
+ * optionally followed by a tab and limits on its reductions, nodes, bytes
+ * and milliseconds (see set_limits).  What's made is a line with the
+ * printed result, and tab-separated counts of reductions, max appnodes
+ * and milliseconds, in memory from alloc_mem.  If the term fails, the line has "!" and the
+ * error instead, the engine needs resetting, and the result is 0.
+ */
+uint8_t eval_line(char* line, char** out, size_t* len)
+{
+    static char failed[80];
+    jmp_buf on_error;
+    struct timespec start, end;
+    struct out_buf ob;
+    unsigned int max_reductions = 0, max_nodes = 0;
+    unsigned long max_bytes = 0, max_millis = 0, usecs;
+    uint16_t start_apps = current_apps;
+    char stats[64];
+    char* tab = strchr(line, '\t');
+    atom a;
+    if (tab != NULL) {
+	*tab = '\0';
+	sscanf(tab + 1, "%u %u %lu %lu", &max_reductions, &max_nodes,
+	       &max_bytes, &max_millis);
+    }
+    ENGINE.error = NULL;
+    ENGINE.on_error = &on_error;
+    if (setjmp(on_error)) {
+	ENGINE.on_error = NULL;
+	sprintf(failed, "!%.60s\t-\t-\t-\n", ENGINE.error);
+	*out = failed;
+	*len = strlen(failed);
+	return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    reductions = 0;
+    max_apps = current_apps;
+    set_limits(max_reductions, max_nodes < MAX_APPS ? max_nodes : MAX_APPS,
+	       max_bytes, max_millis);
+    a = string_to_atom(line);
+    if (ENGINE.error != NULL)
+	engine_error(ENGINE.error);
+    a = reduce(a);
+    ob.size = 256;
+    for (;;) {
+	ob.buf = alloc_mem(ob.size);
+	ob.len = 0;
+	output_context = &ob;
+	putch = sputch;
+	print_atom_reduced(a);
+	if (ob.len < ob.size)
+	    break;
+	free_mem(ob.buf);
+	ob.size = ob.len + 1;
+    }
+    output_context = (void*) stdout;
+    putch = fputch;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usecs = (end.tv_sec - start.tv_sec) * 1000000UL
+	+ end.tv_nsec / 1000 - start.tv_nsec / 1000;
+    sprintf(stats, "\t%u\t%u\t%lu.%03lu\n", reductions,
+	    max_apps - start_apps, usecs / 1000, usecs % 1000);
+    *len = ob.len + strlen(stats);
+    *out = realloc_mem(ob.buf, *len + 1);
+    strcpy(*out + ob.len, stats);
+    free_app_all(a);
+    clear_limits();
+    ENGINE.on_error = NULL;
+    return 1;
+}
+
+/*
+ * In the process for a term, which sends back the line for it.  Anything
+ * unexpected on stderr goes back too.
+ */
+void batch_term(int fd, char* text)
+{
+    char* out;
+    size_t len;
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0)
+	dup2(null_fd, 1);
+    dup2(fd, 2);
+    ENGINE.io_get = no_get;
+    ENGINE.io_put = no_put;
+    eval_line(text, &out, &len);
+    write(fd, out, len);
+    _exit(0);
+}
+
+void start_batch_term(struct batch_slot* s, char* text)
+{
+    int fds[2];
+    s->out = NULL;
+    s->len = s->size = 0;
+    s->status = 0;
+    s->pid = 0;
+    if (text[strspn(text, " \t\r")] == '\0' || pipe(fds) != 0)
+	return;
+    fflush(stdout);
+    fflush(stderr);
+    s->pid = fork();
+    if (s->pid == 0) {
+	close(fds[0]);
+	batch_term(fds[1], text);
+    }
+    close(fds[1]);
+    if (s->pid < 0) {
+	s->pid = 0;
+	s->status = -1;
+	close(fds[0]);
+	return;
+    }
+    s->fd = fds[0];
+}
+
+/* Reads what's arrived from a term's process; returns 1 once it's done. */
+uint8_t read_batch_term(struct batch_slot* s) __z88dk_fastcall
+{
+    ssize_t n;
+    if (s->len == s->size) {
+	s->size = s->size == 0 ? 256 : 2 * s->size;
+	s->out = realloc_mem(s->out, s->size);
+    }
+    n = read(s->fd, s->out + s->len, s->size - s->len);
+    if (n > 0) {
+	s->len += n;
+	return 0;
+    }
+    close(s->fd);
+    waitpid(s->pid, &s->status, 0);
+    s->pid = 0;
+    return 1;
+}
+
+/* A term whose process failed gets "!" and the error, like eval_line. */
+void print_batch_term(struct batch_slot* s) __z88dk_fastcall
+{
+    if (s->status == 0) {
+	if (s->len > 0)
+	    fwrite(s->out, 1, s->len, stdout);
+	else
+	    putchar('\n');
+    } else {
+	while (s->len > 0 && s->out[s->len-1] == '\n')
+	    --s->len;
+	if (s->len > 0)
+	    printf("!%.*s", (int) s->len, s->out);
+	else if (s->status == -1)
+	    printf("!can't fork");
+	else if (WIFSIGNALED(s->status))
+	    printf("!killed by signal %d", WTERMSIG(s->status));
+	else
+	    printf("!exit status %d", WEXITSTATUS(s->status));
+	printf("\t-\t-\t-\n");
+    }
+    if (s->out != NULL)
+	free_mem(s->out);
+}
+
+/* Returns 0 at the end of the input. */
+uint8_t read_line(FILE* in, char** line, size_t* size)
+{
+    size_t len = 0;
+    if (*line == NULL) {
+	*size = 256;
+	*line = alloc_mem(*size);
+    }
+    while (fgets(*line + len, *size - len, in) != NULL) {
+	len += strlen(*line + len);
+	if (len > 0 && (*line)[len-1] == '\n') {
+	    (*line)[len-1] = '\0';
+	    return 1;
+	}
+	*line = realloc_mem(*line, *size *= 2);
+    }
+    return len > 0;
+}
+
+void run_batch(FILE* in) __z88dk_fastcall
+{
+    uint16_t procs = spare_workers + 1;
+    uint16_t window = procs * BATCH_WINDOW;
+    struct batch_slot* slots = alloc_mem(window * sizeof(struct batch_slot));
+    struct pollfd* polls = alloc_mem(procs * sizeof(struct pollfd));
+    uint16_t* polled = alloc_mem(procs * sizeof(uint16_t));
+    uint16_t head = 0, count = 0, running = 0;
+    char* line = NULL;
+    size_t line_size;
+    uint8_t more = 1;
+    spare_workers = 0;
+    for (;;) {
+	uint16_t i, n;
+	while (more && running < procs && count < window) {
+	    struct batch_slot* s = &slots[(head + count) % window];
+	    more = read_line(in, &line, &line_size);
+	    if (!more)
+		break;
+	    start_batch_term(s, line);
+	    ++count;
+	    if (s->pid != 0)
+		++running;
+	}
+	while (count > 0 && slots[head].pid == 0) {
+	    print_batch_term(&slots[head]);
+	    head = (head + 1) % window;
+	    --count;
+	}
+	if (count == 0) {
+	    if (!more)
+		break;
+	    continue;
+	}
+	for (i = n = 0; i < count; ++i) {
+	    uint16_t j = (head + i) % window;
+	    if (slots[j].pid != 0) {
+		polls[n].fd = slots[j].fd;
+		polls[n].events = POLLIN;
+		polled[n++] = j;
+	    }
+	}
+	if (poll(polls, n, -1) < 0)
+	    continue;
+	for (i = 0; i < n; ++i)
+	    if (polls[i].revents != 0 && read_batch_term(&slots[polled[i]]))
+		--running;
+    }
+    fflush(stdout);
+    free_mem(line);
+    free_mem(polled);
+    free_mem(polls);
+    free_mem(slots);
+}
+
+/*
+ * Server mode.
+ *
+ * With -S path, clients connect to a Unix domain socket at path, and each
+ * connection is a session, which sends requests, one per line, like the
+ * lines of a batch, and gets back each one's line, in order.  G reads
+ * what the client sends after the request, and P's output goes to the
+ * client, ahead of the request's line.
+ *
+ * Every session has an engine of its own, and a coroutine (with a stack
+ * of its own) that runs its requests.  When G has no input to read yet,
+ * or P's output is backed up, or the session has had CHECK_GRAIN
+ * reductions, it yields, and the scheduler, in serve, polls for what the
+ * sessions are waiting for, and resumes those that can go on, in turn, so
+ * that a session waiting for its client holds up none of the others.
+ * With -j n, there are n server processes, each with any number of
+ * sessions.  Server processes exit when the parent does, and the parent
+ * replaces any that die.
+ *
+ * The engine is got ready once, with every macro parsed, and kept as it
+ * is then, in shared memory, which every session maps privately, so that
+ * its pages (and the macros in them) are shared by all the sessions of
+ * all the server processes, until a session writes to one, and is given
+ * a copy of its own.  So a new session costs a mapping, rather than a
+ * copy of the whole engine, and after a request that failed, or that
+ * didn't leave the heap as it found it, the engine can just be mapped
+ * again.  Without shared memory, each session has a copy of its own.
+ */
+
+#ifndef MAX_SESSIONS
+#define MAX_SESSIONS 256
+#endif
+/*
+ * Nested reductions go about as deep on the C stack as on the reduction
+ * stack, at well under a kilobyte a level, so that's what a session's
+ * stack allows for.  Where it can, it has a guard page below it, so that
+ * running off the end kills the server process, which is then replaced,
+ * rather than overwriting whatever is there.
+ */
+#ifndef SESSION_STACK
+#define SESSION_STACK ((size_t) MAX_STACK * 1024 + 65536)
+#endif
+#define SESSION_OUTPUT 65536
+#define MAX_REQUEST 1048576
+
+enum { RUNNABLE, WAIT_INPUT, WAIT_OUTPUT, FINISHED };
+
+struct session {
+    int fd;
+    uint8_t state;
+    uint8_t eof;		/* no more input, or the client's gone */
+    uint8_t gone;
+    struct engine* engine;
+    ucontext_t context;
+    char* stack;
+    char* in;			/* what's been read, from in_start on */
+    size_t in_start, in_len, in_size;
+    char* out;			/* what's to be written, from out_start on */
+    size_t out_start, out_len, out_size;
+    char* line;
+    size_t line_size;
+};
+
+struct engine* warm_engine;
+int warm_fd = -1;
+uint16_t warm_apps;
+ucontext_t scheduler;
+struct session* current_session;
+
+/*
+ * Parses every macro once, after which using one just copies it.  Any
+ * that don't parse are left to fail again when they're used.
+ */
+void warm_macros(void)
+{
+    jmp_buf on_error;
+    short i, n = sizeof(builtins)/sizeof(*builtins);
+    atom a;
+    ENGINE.macros = malloc(n * sizeof(atom));
+    if (ENGINE.macros == NULL)
+	return;
+    for (i = 0; i < n; ++i)
+	ENGINE.macros[i] = NOT_REDUCED;
+    ENGINE.on_error = &on_error;
+    if (setjmp(on_error) == 0) {
+	for (i = 0; i < n; ++i) {
+	    ENGINE.error = NULL;
+	    a = string_to_atom(builtins[i][1]);
+	    if (ENGINE.error == NULL)
+		ENGINE.macros[i] = a;
+	    else
+		free_app_all(a);
+	}
+    }
+    ENGINE.on_error = NULL;
+    ENGINE.error = NULL;
+}
+
+/* Switches back to the scheduler until it's possible to go on. */
+void session_wait(uint8_t state) __z88dk_fastcall
+{
+    struct session* s = current_session;
+    s->state = state;
+    swapcontext(&s->context, &scheduler);
+    s->state = RUNNABLE;
+    if (s->gone && ENGINE.on_error != NULL)
+	engine_error("connection closed");
+}
+
+void session_yield(void)
+{
+    session_wait(RUNNABLE);
+}
+
+int session_get(void* io)
+{
+    struct session* s = io;
+    while (s->in_start == s->in_len) {
+	if (s->eof)
+	    return -1;
+	session_wait(WAIT_INPUT);
+    }
+    return (unsigned char) s->in[s->in_start++];
+}
+
+uint8_t grow_buffer(char** buf, size_t* size, size_t needed)
+{
+    size_t new_size = *size == 0 ? 1024 : *size;
+    char* bigger;
+    while (new_size < needed)
+	new_size *= 2;
+    if (new_size == *size)
+	return 1;
+    bigger = realloc(*buf, new_size);
+    if (bigger == NULL)
+	return 0;
+    *buf = bigger;
+    *size = new_size;
+    return 1;
+}
+
+/* Returns zero if the output can't be held on to. */
+uint8_t session_write(const char* buf, size_t len)
+{
+    struct session* s = current_session;
+    if (s->gone)
+	return 1;
+    if (s->out_start > 0) {
+	s->out_len -= s->out_start;
+	memmove(s->out, s->out + s->out_start, s->out_len);
+	s->out_start = 0;
+    }
+    if (!grow_buffer(&s->out, &s->out_size, s->out_len + len))
+	return 0;
+    memcpy(s->out + s->out_len, buf, len);
+    s->out_len += len;
+    return 1;
+}
+
+int session_put(int c, void* io)
+{
+    struct session* s = io;
+    char ch = c;
+    while (s->out_len - s->out_start >= SESSION_OUTPUT && !s->gone)
+	session_wait(WAIT_OUTPUT);
+    if (!session_write(&ch, 1))
+	engine_error("out of memory");
+    return c;
+}
+
+/* The next request, or NULL once there are no more. */
+char* session_line(struct session* s) __z88dk_fastcall
+{
+    char* nl;
+    size_t len;
+    while (s->in == NULL
+	   || (nl = memchr(s->in + s->in_start, '\n',
+			   s->in_len - s->in_start)) == NULL) {
+	if (s->eof || s->in_len - s->in_start > MAX_REQUEST)
+	    return NULL;
+	session_wait(WAIT_INPUT);
+    }
+    len = nl - (s->in + s->in_start);
+    if (!grow_buffer(&s->line, &s->line_size, len + 1))
+	return NULL;
+    memcpy(s->line, s->in + s->in_start, len);
+    s->line[len] = '\0';
+    s->in_start += len + 1;
+    return s->line;
+}
+
+/* Keeps the engine in use as the warm one, in shared memory if possible. */
+uint8_t keep_warm_engine(void)
+{
+    char name[32];
+    sprintf(name, "/mini-sk-%ld", (long) getpid());
+    warm_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (warm_fd >= 0) {
+	void* m = MAP_FAILED;
+	shm_unlink(name);
+	if (ftruncate(warm_fd, sizeof(struct engine)) == 0)
+	    m = mmap(NULL, sizeof(struct engine), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, warm_fd, 0);
+	if (m != MAP_FAILED) {
+	    warm_engine = m;
+	} else {
+	    close(warm_fd);
+	    warm_fd = -1;
+	}
+    }
+    if (warm_engine == NULL)
+	warm_engine = malloc(sizeof(struct engine));
+    if (warm_engine == NULL)
+	return 0;
+    memcpy(warm_engine, engine, sizeof(struct engine));
+    if (warm_fd >= 0)
+	mprotect(warm_engine, sizeof(struct engine), PROT_READ);
+    warm_apps = current_apps;
+    return 1;
+}
+
+/* Maps (or copies) the warm engine, at e, unless e is NULL. */
+struct engine* map_engine(struct engine* e) __z88dk_fastcall
+{
+    if (warm_fd >= 0) {
+	void* m = mmap(e, sizeof(struct engine), PROT_READ | PROT_WRITE,
+		       e != NULL ? MAP_PRIVATE | MAP_FIXED : MAP_PRIVATE,
+		       warm_fd, 0);
+	return m != MAP_FAILED ? m : NULL;
+    }
+    if (e == NULL)
+	e = malloc(sizeof(struct engine));
+    if (e != NULL)
+	memcpy(e, warm_engine, sizeof(struct engine));
+    return e;
+}
+
+void unmap_engine(struct engine* e) __z88dk_fastcall
+{
+    if (warm_fd >= 0)
+	munmap(e, sizeof(struct engine));
+    else
+	free(e);
+}
+
+/*
+ * Puts the session's engine back as it was when it was got ready, except
+ * that its reduction stack is its own.
+ */
+void restore_engine(struct session* s) __z88dk_fastcall
+{
+    free_all_mem();
+    if (map_engine(engine) == NULL)
+	engine_error("out of memory");
+    rs_top_ptr = &red_stack[MAX_STACK];
+    ENGINE.io_get = session_get;
+    ENGINE.io_put = session_put;
+    ENGINE.io_context = s;
+    ENGINE.yield = session_yield;
+    update_check_at();
+}
+
+const char* lost_output = "!out of memory\t-\t-\t-\n";
+
+/* The coroutine for a session. */
+void run_session(void)
+{
+    struct session* s = current_session;
+    char* line;
+    restore_engine(s);
+    while ((line = session_line(s)) != NULL) {
+	char* out;
+	size_t len;
+	uint8_t ok = eval_line(line, &out, &len);
+	/* A result too big to hold on to fails, like any other request. */
+	if (!session_write(out, len)
+	    && !session_write(lost_output, strlen(lost_output)))
+	    s->gone = s->eof = 1;
+	if (ok)
+	    free_mem(out);
+	if (!ok || current_apps != warm_apps || ENGINE.mem_blocks != NULL)
+	    restore_engine(s);
+    }
+    s->state = FINISHED;
+    swapcontext(&s->context, &scheduler);
+}
+
+uint8_t start_session(struct session* s) __z88dk_fastcall
+{
+    if (getcontext(&s->context) != 0)
+	return 0;
+    s->context.uc_stack.ss_sp = s->stack;
+    s->context.uc_stack.ss_size = SESSION_STACK;
+    s->context.uc_link = NULL;
+    makecontext(&s->context, run_session, 0);
+    s->state = RUNNABLE;
+    return 1;
+}
+
+#ifdef MAP_ANONYMOUS
+char* alloc_session_stack(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    char* m = mmap(NULL, SESSION_STACK + page, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+	return NULL;
+    mprotect(m, page, PROT_NONE);
+    return m + page;
+}
+
+void free_session_stack(char* stack) __z88dk_fastcall
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (stack != NULL)
+	munmap(stack - page, SESSION_STACK + page);
+}
+#else
+#define alloc_session_stack() malloc(SESSION_STACK)
+#define free_session_stack(stack) free(stack)
 #endif
 
-atom read_atom()
+struct session* new_session(int fd) __z88dk_fastcall
 {
-    signed char c;
-again:
-    SANITY_CHECK
-    c = getch();
-    if (c == -1)
-	return LIT_TO_ATOM(LIT_I);
-    switch (c) {
-    case ' ':
-    case ')':
-    case '\n':
-	goto again;
-    case '(':
-    case '@': {
-	atom lhs = read_atom();
-	atom rhs = read_atom();
-	return alloc_app(lhs,rhs);
+    struct session* s = calloc(1, sizeof(struct session));
+    if (s == NULL)
+	return NULL;
+    s->fd = fd;
+    s->engine = map_engine(NULL);
+    s->stack = alloc_session_stack();
+    if (s->engine == NULL || s->stack == NULL || !start_session(s)) {
+	if (s->engine != NULL)
+	    unmap_engine(s->engine);
+	free_session_stack(s->stack);
+	free(s);
+	return NULL;
     }
-    case '\'':
-	return LIT_TO_ATOM((unsigned char) getch());
-    case '#': {
-        short n = 0;
-	for (;;) {
-	    c = getch();
-	    if (c < '0' || c > '9')
-		break;
-	    n = n*10+(c - '0');
+    return s;
+}
+
+void free_session(struct session* s) __z88dk_fastcall
+{
+    close(s->fd);
+    engine = s->engine;
+    free_all_mem();
+    engine = &default_engine;
+    unmap_engine(s->engine);
+    free_session_stack(s->stack);
+    free(s->in);
+    free(s->out);
+    free(s->line);
+    free(s);
+}
+
+/* Reads what the client has sent, noting when it's gone. */
+void read_session(struct session* s) __z88dk_fastcall
+{
+    ssize_t n;
+    if (s->in_start > 0) {
+	s->in_len -= s->in_start;
+	memmove(s->in, s->in + s->in_start, s->in_len);
+	s->in_start = 0;
+    }
+    if (!grow_buffer(&s->in, &s->in_size, s->in_len + 256)) {
+	s->gone = s->eof = 1;
+	return;
+    }
+    n = read(s->fd, s->in + s->in_len, s->in_size - s->in_len);
+    if (n > 0)
+	s->in_len += n;
+    else if (n == 0 || errno != EAGAIN)
+	s->eof = 1;
+}
+
+void write_session(struct session* s) __z88dk_fastcall
+{
+    ssize_t n = write(s->fd, s->out + s->out_start,
+		      s->out_len - s->out_start);
+    if (n > 0)
+	s->out_start += n;
+    else if (errno != EAGAIN)
+	s->gone = s->eof = 1;
+}
+
+uint8_t can_run(struct session* s) __z88dk_fastcall
+{
+    switch (s->state) {
+    case RUNNABLE:
+	return 1;
+    case WAIT_INPUT:
+	return s->in_start < s->in_len || s->eof;
+    case WAIT_OUTPUT:
+	return s->out_len - s->out_start < SESSION_OUTPUT || s->gone;
+    default:
+	return 0;
+    }
+}
+
+void serve(int listen_fd, int parent_fd)
+{
+    static struct session* sessions[MAX_SESSIONS];
+    static struct pollfd polls[MAX_SESSIONS + 2];
+    uint16_t n = 0, i;
+    uint8_t runnable = 0;
+    for (;;) {
+	polls[0].fd = parent_fd;
+	polls[0].events = POLLIN;
+	polls[1].fd = n < MAX_SESSIONS ? listen_fd : -1;
+	polls[1].events = POLLIN;
+	for (i = 0; i < n; ++i) {
+	    struct session* s = sessions[i];
+	    polls[i+2].fd = s->gone || (s->eof && s->out_start == s->out_len)
+		? -1 : s->fd;
+	    polls[i+2].events = (s->eof ? 0 : POLLIN)
+		| (s->out_start < s->out_len ? POLLOUT : 0);
 	}
-	if (c != -1)
-	    ungetch(c);
-	/*  printf("inserted church numeral %d: ",n); */
-	{
-	    atom single_succ = alloc_app(LIT_TO_ATOM(LIT_S),
-					 LIT_TO_ATOM(LIT_B));
-	    atom val = alloc_app(LIT_TO_ATOM(LIT_K),LIT_TO_ATOM(LIT_I));
-	    short i;
-	    for (i = 0; i < n; ++i) {
-		val = alloc_app(copy_atom(single_succ),val);
+	if (poll(polls, n + 2, runnable ? 0 : -1) < 0)
+	    continue;
+	if (polls[0].revents != 0)
+	    _exit(0);
+	runnable = 0;
+	for (i = n; i-- > 0; ) {
+	    struct session* s = sessions[i];
+	    if (polls[i+2].revents & POLLOUT)
+		write_session(s);
+	    if (polls[i+2].revents & (POLLIN | POLLHUP | POLLERR))
+		read_session(s);
+	    if (can_run(s)) {
+		current_session = s;
+		engine = s->engine;
+		swapcontext(&scheduler, &s->context);
+		engine = &default_engine;
+	    }
+	    if (s->state == FINISHED
+		&& (s->out_start == s->out_len || s->gone)) {
+		free_session(s);
+		sessions[i] = sessions[--n];
+	    } else if (can_run(s)) {
+		runnable = 1;
+	    }
+	}
+	if (polls[1].revents != 0) {
+	    int fd = accept(listen_fd, NULL, NULL);
+	    if (fd >= 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		sessions[n] = new_session(fd);
+		if (sessions[n] != NULL) {
+		    ++n;
+		    runnable = 1;
+		} else {
+		    close(fd);
+		}
 	    }
-	    free_app_all(single_succ);
-	    /* print_atom(val); putchar('\n'); */
-	    return val;
 	}
     }
-#ifndef TINY_VERSION
-    case '$': {
-        char ident[20];
-	char* cp = ident;
-	short i;
-	for (;;) {
-	    c = getch();
-	    if (c < '0' || c > 'z' || (c < 'A' && c > '9'))
-		break;
-	    *cp++ = c;
+}
+
+/*
+ * Each server process has a pipe from the parent, and exits when it sees
+ * the end of it, so it mustn't keep any of the other processes' pipes.
+ */
+struct server_proc {
+    pid_t pid;
+    int fd;			/* the write end of its pipe, or -1 */
+    time_t started;
+    unsigned int delay;		/* before restarting it, in seconds */
+};
+
+#define MAX_RESTART_DELAY 64
+
+void start_server(int listen_fd, struct server_proc* procs, uint16_t n,
+		  uint16_t i)
+{
+    int fds[2];
+    uint16_t j;
+    procs[i].pid = -1;
+    procs[i].started = time(NULL);
+    if (pipe(fds) != 0)
+	return;
+    procs[i].pid = fork();
+    if (procs[i].pid == 0) {
+	close(fds[1]);
+	for (j = 0; j < n; ++j)
+	    if (procs[j].fd >= 0)
+		close(procs[j].fd);
+	serve(listen_fd, fds[0]);
+    }
+    close(fds[0]);
+    if (procs[i].pid < 0)
+	close(fds[1]);
+    else
+	procs[i].fd = fds[1];
+}
+
+int run_server(const char* path) __z88dk_fastcall
+{
+    struct sockaddr_un addr;
+    uint16_t n = spare_workers + 1, i;
+    struct server_proc* procs = malloc(n * sizeof(struct server_proc));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || procs == NULL) {
+	perror("server");
+	return 2;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0
+	|| listen(fd, 64) != 0) {
+	perror(path);
+	return 2;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+    spare_workers = 0;
+    speculate_at = (unsigned int) -1;
+    warm_macros();
+    if (!keep_warm_engine()) {
+	perror("server");
+	return 2;
+    }
+    fflush(stdout);
+    for (i = 0; i < n; ++i) {
+	procs[i].fd = -1;
+	procs[i].delay = 1;
+    }
+    for (i = 0; i < n; ++i)
+	start_server(fd, procs, n, i);
+    for (;;) {
+	int status;
+	pid_t pid = wait(&status);
+	if (pid < 0) {
+	    perror("server");
+	    return 2;
 	}
-	if (c != -1) 
-	    ungetch(c);
-	*cp = '\0';
-	for (i = 0; i < sizeof(builtins)/sizeof(*builtins); ++i) {
-	    if (!strcmp(ident,builtins[i][0]))
-		return string_to_atom(builtins[i][1]);
+	for (i = 0; i < n; ++i) {
+	    if (procs[i].pid != pid)
+		continue;
+	    close(procs[i].fd);
+	    procs[i].fd = -1;
+	    /* One that keeps dying straight away is restarted less often. */
+	    if (time(NULL) - procs[i].started > MAX_RESTART_DELAY)
+		procs[i].delay = 1;
+	    fprintf(stderr, "server process %ld died, restarting in %us\n",
+		    (long) pid, procs[i].delay);
+	    sleep(procs[i].delay);
+	    if (procs[i].delay < MAX_RESTART_DELAY)
+		procs[i].delay *= 2;
+	    start_server(fd, procs, n, i);
 	}
-	printf("Unkown macro: %s\n", ident);
-	goto again;
     }
+}
 #endif
-    default:
-	if (c >= '0' && c <= '9') {
-	    unsigned short num = 0;
-	    for (;;) {
-		num += c - '0';
-		c = getch();
-		if (c < '0' || c > '9')
-		    break;
-		num *= 10;
-	    }
-	    if (c != -1)
-		ungetch(c);
-	    return LIT_TO_ATOM(num & 0x7fff);
-	}
-	if (c >= 'a' && c <= 'z')
-	    return LIT_TO_ATOM(c);
-	{
-	    unsigned char i;
-	    for (i = 0; i < (unsigned char) ARRAY_SIZE(reps); ++i)
-		if (reps[i].key == (char) c)
-		    return LIT_TO_ATOM(reps[i].value);
+
+/*
+ * (($pmap f) l), (($pfilter p) l) and ((($pfold f) z) l) force the whole
+ * spine of l, and split its elements into chunks, one for each process
+ * that -j allows.  Each chunk is done by a worker with a heap of its own,
+ * and its results are sent back, so the elements' results should be much
+ * smaller than the work that goes into them.  $pmap's results and
+ * $pfold's are evaluated completely, as by $deepseq.  $pfold's f must be
+ * associative, with z as its unit, as each chunk is folded from z, and the
+ * chunks' results are then combined pairwise, in a tree.
+ */
+
+#define PAR_MAP 0
+#define PAR_FILTER 1
+#define PAR_FOLD 2
+
+/* Does one chunk of the work, giving an array of results. */
+atom do_chunk(uint8_t op, atom f, atom z, atom* elems, uint16_t len)
+{
+    struct arr_buf* buf = alloc_arr_buf(op == PAR_FOLD ? 1 : len);
+    atom acc = copy_atom(z);
+    uint16_t i;
+    for (i = 0; i < len; ++i) {
+	if (op == PAR_FOLD) {
+	    acc = alloc_app(alloc_app(copy_atom(f), acc), copy_atom(elems[i]));
+	    deep_reduce(&acc);
+	} else {
+	    atom r = alloc_app(copy_atom(f), copy_atom(elems[i]));
+	    if (op == PAR_MAP)
+		deep_reduce(&r);
+	    else
+		r = reduce(r);
+	    buf->elems[i] = r;
 	}
-	printf("Unrecognized char '%c'\n", c);
-	goto again;
     }
+    if (op == PAR_FOLD)
+	buf->elems[0] = acc;
+    else
+	free_app_all(acc);
+    return arr_to_atom(buf, 0, buf->len);
 }
 
-int main()
+#ifdef USE_POSIX
+struct chunk {
+    uint16_t start;
+    uint16_t len;
+    pid_t pid;
+    int fd;
+};
+
+void start_chunk(struct chunk* c, uint8_t op, atom f, atom z, atom* elems)
 {
-#ifdef __Z88DK
-#ifdef __ZXNEXT
-    putchar(14);
-#else
-#ifdef __SPECTRUM
-    zx_cls(PAPER_WHITE);
-#endif
-#endif
-#endif
-    init_apps();
-#ifndef TINY_VERSION
-    input_context = (void*) stdin;
-#endif
-    SANITY_CHECK
-    printf("Mini-SK, combinators & more...\n");
-#ifndef TINY_VERSION
-    printf("\nPredefined macros");
-    { 
-	int i;
-	char comma = ':';
-	for (i = 0; i < sizeof(builtins)/sizeof(*builtins); ++i) {
-	    printf("%c $%s", comma, builtins[i][0]);
-	    comma = ',';
+    int fds[2];
+    c->pid = 0;
+    if (pipe(fds) != 0)
+	return;
+    fflush(stdout);
+    c->pid = fork();
+    if (c->pid == 0) {
+	FILE* out;
+	close(fds[0]);
+	start_worker(fds[1], 0);
+	out = fdopen(fds[1], "wb");
+	if (out != NULL) {
+	    send_graph(out, do_chunk(op, f, z, elems + c->start, c->len));
+	    fclose(out);
 	}
+	_exit(0);
     }
-    putchar('\n');
-#endif
-    for(;;) {
-	atom a;
-	if (feof(stdin))
-	    break;
-	SANITY_CHECK
-	reductions = 0;
-	max_apps = current_apps;
-#if defined(USE_MINILIB) && defined(__SPECTRUM)
-	input_prompt = "Term> ";
-#else
-	printf("\nTerm> ");
-#endif
-	a = read_atom();
-	putchar('\n');
-	{
-	    char c;
-	    do {
-		c = getch();
-	    } while (c == ' ' || c == ')');
-	    if (c != '\n')
-		ungetch(c);
+    close(fds[1]);
+    if (c->pid < 0) {
+	c->pid = 0;
+	close(fds[0]);
+	return;
+    }
+    c->fd = fds[0];
+}
+
+/* If the worker's results don't arrive, the chunk is done here instead. */
+atom join_chunk(struct chunk* c, uint8_t op, atom f, atom z, atom* elems)
+{
+    atom result = NOT_REDUCED;
+    if (c->pid != 0) {
+	FILE* in = fdopen(c->fd, "rb");
+	if (in != NULL) {
+	    result = receive_graph(in);
+	    fclose(in);
+	} else {
+	    close(c->fd);
 	}
-	print_atom(a); printf("\n--->\n");
-    SANITY_CHECK
-#if defined(USE_MINILIB) && defined(__SPECTRUM)
-	input_prompt += 4;
-#endif
-	a = reduce(a);
-    SANITY_CHECK
-	print_atom_reduced(a); putchar('\n');
-    SANITY_CHECK
-	printf("\n%u reductions, %d max appnodes\n", reductions, max_apps);
-	free_app_all(a);
+	waitpid(c->pid, NULL, 0);
+	if (result != NOT_REDUCED && !IS_BOXED(result, LIT_ARR)) {
+	    free_app_all(result);
+	    result = NOT_REDUCED;
+	}
+    }
+    if (result == NOT_REDUCED)
+	result = do_chunk(op, f, z, elems + c->start, c->len);
+    return result;
+}
+#endif
+
+/*
+ * Gives an array of the chunks' arrays of results.  Takes over our
+ * reference to the array of elements.
+ */
+atom do_chunks(uint8_t op, atom f, atom z, atom in)
+{
+    struct arr_box* ab = &BOX_OF(in).u.arr;
+    atom* elems = ab->buf->elems + ab->start;
+    uint16_t n = ab->len;
+    struct arr_buf* out;
+#ifdef USE_POSIX
+    struct chunk* chunks;
+    uint16_t k = USES_WORKERS ? spare_workers + 1 : 1;
+    uint16_t i, start = 0;
+    if (k > n)
+	k = n > 0 ? n : 1;
+    /* Not static, since f may use $pmap itself, even with no workers. */
+    chunks = alloc_mem(k * sizeof(struct chunk));
+    for (i = 0; i < k; ++i) {
+	chunks[i].start = start;
+	start = (uint16_t) ((unsigned long) n * (i+1) / k);
+	chunks[i].len = start - chunks[i].start;
+	chunks[i].pid = 0;
     }
-    return 0;
+    spare_workers -= k - 1;
+    for (i = 1; i < k; ++i)
+	start_chunk(&chunks[i], op, f, z, elems);
+    out = alloc_arr_buf(k);
+    out->elems[0] = do_chunk(op, f, z, elems, chunks[0].len);
+    for (i = 1; i < k; ++i)
+	out->elems[i] = join_chunk(&chunks[i], op, f, z, elems);
+    spare_workers += k - 1;
+    free_mem(chunks);
+#else
+    out = alloc_arr_buf(1);
+    out->elems[0] = do_chunk(op, f, z, elems, n);
+#endif
+    free_app_all(in);
+    return arr_to_atom(out, 0, out->len);
 }
 
+atom list_to_arr(atom list) __z88dk_fastcall
+{
+    struct arr_buf* buf = list_to_arr_buf(list);
+    return arr_to_atom(buf, 0, buf->len);
+}
 
-atom alloc_app(atom func, atom arg)
+/*
+ * Strings the chunks' results together into a list, or, for $pfilter,
+ * the elements whose results are K.
+ */
+atom chunks_to_list(atom chunks, atom in, char filter)
 {
-    atom next_app = app_freelist;
-    SANITY_CHECK
-    if (next_app == INDEX_TO_ATOM(MAX_APPS)) {
-	fprintf(stderr, "out of app space\n");
-	exit(2);
+    struct arr_box* cb = &BOX_OF(chunks).u.arr;
+    struct arr_box* ib = &BOX_OF(in).u.arr;
+    atom list = alloc_app(LIT_TO_ATOM(LIT_K), LIT_TO_ATOM(LIT_K));
+    uint16_t i = cb->len, j, n = ib->len;
+    while (i-- > 0) {
+	struct arr_box* rb = &BOX_OF(cb->buf->elems[cb->start + i]).u.arr;
+	for (j = rb->len; j-- > 0; ) {
+	    atom r = rb->buf->elems[rb->start + j];
+	    --n;
+	    if (filter && r != LIT_TO_ATOM(LIT_K))
+		continue;
+	    r = filter ? ib->buf->elems[ib->start + n] : r;
+	    list = alloc_app(alloc_app(LIT_TO_ATOM(LIT_pair), copy_atom(r)), list);
+	}
     }
-    assert(NODE_REFCOUNT(next_app) == 0x8888);
-    app_freelist = NODE_FUNC(next_app);
-    NODE_FUNC(next_app) = func;
-    NODE_ARG(next_app) = arg;
-    NODE_REFCOUNT(next_app) = 1;
-    debug_printf(("# ALLOC: node= %04x, lhs= %04x, rhs= %04x\n", next_app, func, arg));
-    SANITY_CHECK
-    ++current_apps;
-    if (current_apps > max_apps)
-	max_apps = current_apps;
-    return next_app;
+    return list;
 }
 
-void free_app(atom app) __z88dk_fastcall
+atom red_pmap(atom curr) __z88dk_fastcall
 {
-    SANITY_CHECK
-    assert(NODE_REFCOUNT(app) != 0x8888);
-    NODE_FUNC(app) = app_freelist;
-    app_freelist = app;
-    --current_apps;
-    SANITY_CHECKING(NODE_REFCOUNT(app) = 0x8888;)
-    debug_printf(("# FREE: node= %04x, lhs= %04x, rhs= %04x\n", app, NODE_FUNC(app), NODE_ARG(app)));
+    atom in = list_to_arr(copy_atom(NODE_ARG(curr)));
+    atom chunks = do_chunks(PAR_MAP, NODE_ARG(rs_top_ptr[0]),
+			    LIT_TO_ATOM(LIT_I), copy_atom(in));
+    atom list = chunks_to_list(chunks, in, 0);
+    free_app_all(chunks);
+    free_app_all(in);
+    return replace(curr, list);
 }
 
-char free_app_all(atom app) __z88dk_fastcall
+atom red_pfilter(atom curr) __z88dk_fastcall
 {
-    SANITY_CHECK
-    if (IS_LIT(app))
-	return 0;
-    debug_printf(("# DEC: node= %04x, lhs= %04x, rhs= %04x\n", app, NODE_FUNC(app), NODE_ARG(app)));
-    if (--NODE_REFCOUNT(app))
-	return 0;
-    free_app_all(NODE_ARG(app));
-    free_app_all(NODE_FUNC(app));
-    free_app(app);
-    return 1;
+    atom in = list_to_arr(copy_atom(NODE_ARG(curr)));
+    atom chunks = do_chunks(PAR_FILTER, NODE_ARG(rs_top_ptr[0]),
+			    LIT_TO_ATOM(LIT_I), copy_atom(in));
+    atom list = chunks_to_list(chunks, in, 1);
+    free_app_all(chunks);
+    free_app_all(in);
+    return replace(curr, list);
 }
 
-atom copy_atom(atom a) __z88dk_fastcall
+atom red_pfold(atom curr) __z88dk_fastcall
 {
-    SANITY_CHECK
-    if (IS_LIT(a))
-	return a;
-    debug_printf(("# INC: node= %04x, lhs= %04x, rhs= %04x\n", a, NODE_FUNC(a), NODE_ARG(a)));
-    assert(NODE_REFCOUNT(a) != 0x8888);
-    assert(NODE_REFCOUNT(a) != 0x9e37);
-    ++NODE_REFCOUNT(a);
-    return a;
+    atom f = NODE_ARG(rs_top_ptr[0]);
+    atom chunks = do_chunks(PAR_FOLD, f, NODE_ARG(rs_top_ptr[1]),
+			    list_to_arr(copy_atom(NODE_ARG(curr))));
+    struct arr_box* cb = &BOX_OF(chunks).u.arr;
+    uint16_t k = cb->len, i;
+    atom* parts = alloc_mem(k * sizeof(atom));
+    atom result;
+    for (i = 0; i < k; ++i) {
+	struct arr_box* rb = &BOX_OF(cb->buf->elems[cb->start + i]).u.arr;
+	parts[i] = copy_atom(rb->buf->elems[rb->start]);
+    }
+    free_app_all(chunks);
+    for (; k > 1; k = (k+1) / 2) {
+	for (i = 0; i+1 < k; i += 2) {
+	    parts[i/2] = alloc_app(alloc_app(copy_atom(f), parts[i]), parts[i+1]);
+	    deep_reduce(&parts[i/2]);
+	}
+	if (k & 1)
+	    parts[k/2] = parts[k-1];
+    }
+    result = parts[0];
+    free_mem(parts);
+    return replace(curr, result);
 }
 
-atom replace(atom orig, atom reduced)
+/*
+ * Applies fn to arg, reusing the app node from the last time round if
+ * nothing else has kept hold of it.  Either way, the caller keeps a
+ * reference to the node, and the result is reduced.
+ */
+atom reduce_applied(atom* nodep, atom fn, atom arg)
 {
-    if (!free_app_all(orig)) {
-	copy_atom(reduced);
-	free_app_all(NODE_FUNC(orig));
-	free_app_all(NODE_ARG(orig));
-	NODE_FUNC(orig) = LIT_TO_ATOM(LIT_I);
-	NODE_ARG(orig)  = reduced;
+    atom node = *nodep;
+    if (node != LIT_TO_ATOM(LIT_I) && NODE_REFCOUNT(node) == 1) {
+	free_app_all(NODE_FUNC(node));
+	free_app_all(NODE_ARG(node));
+	NODE_FUNC(node) = copy_atom(fn);
+	NODE_ARG(node) = arg;
+    } else {
+	free_app_all(node);
+	*nodep = node = alloc_app(copy_atom(fn), arg);
     }
-    return reduced;
+    return reduce(copy_atom(node));
 }
 
-#ifndef MAX_STACK
-#define MAX_STACK 512
-#endif
-
-#ifdef USE_MINILIB
-#ifdef TINY_VERSION
-atom* rs_top_ptr = (atom*) 0x8000;
-const atom* red_stack  = ((atom*) 0x7000);
-#else
-atom* rs_top_ptr = (atom*) 0xff20;
-const atom* red_stack  = ((atom*) 0xef20);
-#endif
-#else
-atom red_stack[MAX_STACK+1];
-atom* rs_top_ptr = &red_stack[MAX_STACK];
+/*
+ * ((($while p) f) x) gives x if (p x) isn't K, and otherwise carries on
+ * with (f x), evaluating as it goes.  When p and f are arithmetic
+ * sections (as understood by $vmap) and x is a literal, the whole loop
+ * runs without building anything, counting a reduction each time round,
+ * so that it's still subject to limits.
+ */
+atom red_while(atom curr) __z88dk_fastcall
+{
+    atom test = reduce_arg(rs_top_ptr[0]);
+    atom step = reduce_arg(rs_top_ptr[1]);
+    atom state = copy_atom(reduce_arg(curr));
+    atom test_node = LIT_TO_ATOM(LIT_I);
+    atom step_node = LIT_TO_ATOM(LIT_I);
+    struct vprog test_prog, step_prog;
+    test_prog.len = step_prog.len = 0;
+    if (IS_LIT(state) && compile_vsteps(&test_prog, test)
+	&& compile_vsteps(&step_prog, step)) {
+	for (;;) {
+	    atom result = state;
+	    if (!run_vprog(&test_prog, &result, 1)
+		|| result != LIT_TO_ATOM(LIT_K))
+		break;
+	    if (!run_vprog(&step_prog, &state, 1))
+		break;
+	    ++reductions;
+#ifdef MULTIPLE_ENGINES
+	    if (reductions >= ENGINE.check_at)
+		check_reductions();
 #endif
+	}
+	return replace(curr, state);
+    }
+    for (;;) {
+	atom result = reduce_applied(&test_node, test, copy_atom(state));
+	char done = result != LIT_TO_ATOM(LIT_K);
+	free_app_all(result);
+	if (done)
+	    break;
+	state = reduce_applied(&step_node, step, state);
+    }
+    free_app_all(test_node);
+    free_app_all(step_node);
+    return replace(curr, state);
+}
 
-typedef atom (*reducer_fn)(atom curr) __z88dk_fastcall;
+/*
+ * Fused arithmetic, doing in one reduction what would otherwise take two
+ * or three.
+ */
 
-atom red_ident(atom curr) __z88dk_fastcall
+/* (((($madd k) a) b) c) passes a*b+c to k. */
+atom red_madd(atom curr) __z88dk_fastcall
 {
-    return replace(curr, copy_atom(NODE_ARG(curr)));
+    literal a = lit_arg(1);
+    literal b = lit_arg(2);
+    return builtin_nc_result(3, LIT_TO_ATOM((a*b + lit_arg(3)) & 0x7fff));
 }
 
-atom red_const(atom curr) __z88dk_fastcall
+/* (((($clamp k) lo) hi) x) passes x, limited to lo..hi, to k. */
+atom red_clamp(atom curr) __z88dk_fastcall
 {
-    return replace(curr, copy_atom(NODE_ARG(rs_top_ptr[0])));
+    literal lo = lit_arg(1);
+    literal hi = lit_arg(2);
+    literal x = lit_arg(3);
+    return builtin_nc_result(3, LIT_TO_ATOM(x < lo ? lo : x > hi ? hi : x));
 }
 
-atom red_false(atom curr) __z88dk_fastcall
+/* (((($iflt a) b) t) e) gives t if a < b, and e otherwise. */
+atom red_iflt(atom curr) __z88dk_fastcall
 {
-    return replace(curr, copy_atom(NODE_ARG(curr)));
+    literal a = lit_arg(0);
+    literal b = lit_arg(1);
+    return replace(curr, copy_atom(NODE_ARG(rs_top_ptr[a < b ? 2 : 3])));
 }
 
-atom red_jump(atom curr) __z88dk_fastcall
+/* (((($ifeq a) b) t) e) gives t if a = b, and e otherwise. */
+atom red_ifeq(atom curr) __z88dk_fastcall
 {
-    atom yx = alloc_app(copy_atom(NODE_ARG(curr)), 
-			copy_atom(NODE_ARG(rs_top_ptr[0])));
-    return replace(curr, yx);
+    literal a = lit_arg(0);
+    literal b = lit_arg(1);
+    return replace(curr, copy_atom(NODE_ARG(rs_top_ptr[a == b ? 2 : 3])));
 }
 
-atom red_fusion(atom curr) __z88dk_fastcall
-{
-    atom fx = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[0])),
-			copy_atom(NODE_ARG(curr)));
-    atom gx = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[1])),
-			copy_atom(NODE_ARG(curr)));
-    return replace(curr,alloc_app(fx,gx));
-}
+/*
+ * Random numbers come from a PCG generator with 30 bits of state: a
+ * linear congruential generator whose output is permuted, by an xorshift
+ * and a shift chosen by the top bits, to give 15-bit literals.  A
+ * generator is (($pcg hi) lo), holding the two halves of its state, and
+ * applying it to k gives ((k v) g), where v is its next value and g the
+ * next generator.  Literals used as generators are taken as seeds.
+ */
 
-atom red_compose(atom curr) __z88dk_fastcall
+#define PCG_MULT 747796405UL
+#define PCG_INC  743852805UL
+#define PCG_MASK 0x3fffffffUL
+
+unsigned long pcg_step(unsigned long state) __z88dk_fastcall
 {
-    atom f  = copy_atom(NODE_ARG(rs_top_ptr[0]));
-    atom gx = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[1])),
-			copy_atom(NODE_ARG(curr)));
-    return replace(curr,alloc_app(f,gx));
+    return (state * PCG_MULT + PCG_INC) & PCG_MASK;
 }
 
-atom red_flip(atom curr) __z88dk_fastcall
+literal pcg_output(unsigned long state) __z88dk_fastcall
 {
-    atom fy = alloc_app(copy_atom(NODE_ARG(rs_top_ptr[0])),
-			copy_atom(NODE_ARG(curr)));
-    atom x  = copy_atom(NODE_ARG(rs_top_ptr[1]));
-    return replace(curr,alloc_app(fy,x));
+    return (literal) ((((state >> 10) ^ state) >> ((state >> 28) + 10))
+		      & 0x7fff);
 }
 
-atom red_y(atom curr) __z88dk_fastcall
+atom pcg_to_atom(unsigned long state) __z88dk_fastcall
 {
-    /*
-     * Note: It migtht be tempting to write
-     *     return replace(curr,alloc_app(copy_atom(NODE_ARG(curr)),
-     *      				       copy_atom(curr))); 
-     * but that would make a cycle, and that's not cool given that we use
-     * reference countining.  Thus this is one of the few rules where we
-     * don't use replace.
-     */
-    return alloc_app(copy_atom(NODE_ARG(curr)), curr);
+    return alloc_app(alloc_app(LIT_TO_ATOM(LIT_pcg),
+			       LIT_TO_ATOM((literal) (state >> 15))),
+		     LIT_TO_ATOM((literal) (state & 0x7fff)));
 }
 
-atom red_putchar(atom curr) __z88dk_fastcall
+/* Gets the state of a reduced generator, seeding it if it's a literal. */
+unsigned long atom_to_pcg(atom g) __z88dk_fastcall
 {
-    atom reduced = reduce(NODE_ARG(curr));
-    NODE_ARG(curr) = reduced;
-    putchar(IS_LIT(reduced) ? LIT_SUBTYPE(ATOM_TO_LIT(reduced)) : '*');
-    return replace(curr,copy_atom(NODE_ARG(rs_top_ptr[0])));
+    unsigned long state = 0;
+    if (!IS_LIT(g) && !IS_LIT(NODE_FUNC(g))
+	&& NODE_FUNC(NODE_FUNC(g)) == LIT_TO_ATOM(LIT_pcg)) {
+	atom hi = reduce_arg(NODE_FUNC(g));
+	atom lo = reduce_arg(g);
+	if (IS_LIT(hi))
+	    state = (unsigned long) ATOM_TO_LIT(hi) << 15;
+	if (IS_LIT(lo))
+	    state |= ATOM_TO_LIT(lo);
+	return state;
+    }
+    state = pcg_step(state);
+    if (IS_LIT(g))
+	state += ATOM_TO_LIT(g);
+    return pcg_step(state);
 }
 
-atom red_getchar(atom curr) __z88dk_fastcall
+/* ($rng seed) gives a generator. */
+atom red_rng(atom curr) __z88dk_fastcall
 {
-    atom arg0 = NODE_ARG(curr);
-    atom result = LIT_TO_ATOM(getchar());
-    return replace(curr, alloc_app(copy_atom(arg0), result));
+    return replace(curr, pcg_to_atom(atom_to_pcg(reduce_arg(curr))));
 }
 
-literal other_lit;
-
-literal eval_two_lits(atom curr) __z88dk_fastcall
+/* ((($pcg hi) lo) k) */
+atom red_pcg(atom curr) __z88dk_fastcall
 {
-    atom reduced_lhs = reduce(NODE_ARG(rs_top_ptr[1]));
-    NODE_ARG(rs_top_ptr[1]) = reduced_lhs;
-    other_lit = IS_LIT(reduced_lhs) ? ATOM_TO_LIT(reduced_lhs) : 0;
-    {
-	atom reduced_rhs = reduce(NODE_ARG(curr));
-	NODE_ARG(curr) = reduced_lhs;
-	return  IS_LIT(reduced_rhs) ? ATOM_TO_LIT(reduced_rhs) : 0;
-    }
-    /* return (((uint32_t) lhs_lit) << 16) | rhs_lit; */
+    unsigned long state = ((unsigned long) lit_arg(0) << 15 | lit_arg(1))
+	& PCG_MASK;
+    return replace(curr,
+		   alloc_app(alloc_app(copy_atom(NODE_ARG(curr)),
+				       LIT_TO_ATOM(pcg_output(state))),
+			     pcg_to_atom(pcg_step(state))));
 }
 
-atom builtin_2c_result(atom result) __z88dk_fastcall
+/* ((($rands k) n) g) gives ((k a) g'), where a is an array of n values. */
+atom red_rands(atom curr) __z88dk_fastcall
 {
-    atom arg0 = NODE_ARG(rs_top_ptr[0]);
-    if (arg0 == LIT_TO_ATOM(LIT_I)) {
-	return replace(rs_top_ptr[2], result);
-    } else {
-	return replace(rs_top_ptr[2], alloc_app(copy_atom(arg0), result));
+    literal n = lit_arg(1);
+    unsigned long state = atom_to_pcg(reduce_arg(curr));
+    struct arr_buf* buf = alloc_arr_buf(n);
+    literal i;
+    for (i = 0; i < n; ++i) {
+	buf->elems[i] = LIT_TO_ATOM(pcg_output(state));
+	state = pcg_step(state);
     }
+    return replace(curr,
+		   alloc_app(alloc_app(copy_atom(NODE_ARG(rs_top_ptr[0])),
+				       arr_to_atom(buf, 0, n)),
+			     pcg_to_atom(state)));
 }
 
-atom red_plus(atom curr) __z88dk_fastcall
+/* ($randlist g) gives the endless lazy list of g's values. */
+atom red_randlist(atom curr) __z88dk_fastcall
 {
-    literal rhs_lit = eval_two_lits(curr);
-    return builtin_2c_result(LIT_TO_ATOM((other_lit+rhs_lit) & 0x7fff));
+    unsigned long state = atom_to_pcg(reduce_arg(curr));
+    return replace(curr,
+		   alloc_app(alloc_app(LIT_TO_ATOM(LIT_pair),
+				       LIT_TO_ATOM(pcg_output(state))),
+			     alloc_app(LIT_TO_ATOM(LIT_randlist),
+				       pcg_to_atom(pcg_step(state)))));
 }
 
-atom red_minus(atom curr) __z88dk_fastcall
+/* Map keys are literals, and anything else is treated as zero. */
+literal map_key(atom a) __z88dk_fastcall
 {
-    literal rhs_lit = eval_two_lits(curr);
-    return builtin_2c_result(LIT_TO_ATOM((other_lit-rhs_lit) & 0x7fff));
+    return IS_LIT(a) ? ATOM_TO_LIT(a) : 0;
 }
 
-atom red_times(atom curr) __z88dk_fastcall
+/* (((($minsert k) m) key) v) */
+atom red_minsert(atom curr) __z88dk_fastcall
 {
-    literal rhs_lit = eval_two_lits(curr);
-    return builtin_2c_result(LIT_TO_ATOM((other_lit*rhs_lit) & 0x7fff));
+    struct map_box* mb = atom_to_map(reduce_arg(rs_top_ptr[1]));
+    literal key = map_key(reduce_arg(rs_top_ptr[2]));
+    char added;
+    struct map_node* root =
+	map_insert(mb->root, key, copy_atom(NODE_ARG(curr)), 0, &added);
+    return builtin_3c_result(map_to_atom(root, mb->size + added));
 }
 
-atom red_div(atom curr) __z88dk_fastcall
+/* (((($mlookup k) m) key) d) passes d to k if key isn't in m. */
+atom red_mlookup(atom curr) __z88dk_fastcall
 {
-    literal rhs_lit = eval_two_lits(curr);
-    return builtin_2c_result(LIT_TO_ATOM((other_lit/rhs_lit) & 0x7fff));
+    struct map_box* mb = atom_to_map(reduce_arg(rs_top_ptr[1]));
+    atom* vp = map_lookup(mb->root, map_key(reduce_arg(rs_top_ptr[2])));
+    return builtin_3c_result(copy_atom(vp ? *vp : NODE_ARG(curr)));
 }
 
-atom red_eq(atom curr) __z88dk_fastcall
+/* ((($mdelete k) m) key) */
+atom red_mdelete(atom curr) __z88dk_fastcall
 {
-    literal rhs_lit = eval_two_lits(curr);
-    return builtin_2c_result(LIT_TO_ATOM(other_lit==rhs_lit ? LIT_K : LIT_F));
+    struct map_box* mb = atom_to_map(reduce_arg(rs_top_ptr[1]));
+    literal key = map_key(reduce_arg(curr));
+    char removed;
+    struct map_node* root;
+    if (mb->root == NULL)
+	return builtin_2c_result(map_to_atom(NULL, 0));
+    root = map_delete(mb->root, key, 0, &removed);
+    return builtin_2c_result(map_to_atom(root, mb->size - removed));
 }
 
-atom red_lt(atom curr) __z88dk_fastcall
+atom red_msize(atom curr) __z88dk_fastcall
 {
-    literal rhs_lit = eval_two_lits(curr);
-    return builtin_2c_result(LIT_TO_ATOM(other_lit < rhs_lit ? LIT_K : LIT_F));
+    atom reduced = reduce_arg(curr);
+    return builtin_1c_result(LIT_TO_ATOM(atom_to_map(reduced)->size & 0x7fff));
 }
+#endif
 
 reducer_fn reducers[] = {
     red_ident,
@@ -882,12 +5550,74 @@ reducer_fn reducers[] = {
     red_jump,
     red_eq,
     red_lt,
-    red_getchar
+    red_getchar,
+#ifndef TINY_VERSION
+    red_fadd,
+    red_fsub,
+    red_fmul,
+    red_fdiv,
+    red_feq,
+    red_flt,
+    red_itof,
+    red_ftoi,
+    red_str,
+    red_slen,
+    red_sslice,
+    red_scat,
+    red_arr,
+    red_afromlist,
+    red_aindex,
+    red_alen,
+    red_aslice,
+    red_aset,
+    red_amodify,
+    red_minsert,
+    red_mlookup,
+    red_mdelete,
+    red_msize,
+    red_vmap,
+    red_num,
+    red_nsucc,
+    red_npred,
+    red_niszero,
+    red_nplus,
+    red_nsub,
+    red_ntimes,
+    red_neq,
+    red_nfact,
+    red_ntoi,
+    red_iton,
+    red_pair,
+    red_case,
+    red_seq,
+    red_deepseq,
+    red_while,
+    red_madd,
+    red_clamp,
+    red_iflt,
+    red_ifeq,
+    red_rng,
+    red_pcg,
+    red_rands,
+    red_randlist,
+    red_par,
+#ifdef USE_POSIX
+    red_spark,
+#else
+    red_ident,		/* there are no sparks without USE_POSIX */
+#endif
+    red_pmap,
+    red_pfilter,
+    red_pfold
+#endif
 };
 
 atom reduce(atom curr) __z88dk_fastcall
 {
     uint16_t stack_len;
+#ifndef TINY_VERSION
+    const atom* stack_end = red_stack;
+#endif
     assert(rs_top_ptr >= red_stack);
     stack_len = 0;
     debug_printf(("# START: stack_len= %d, curr= %04x, rs_top_ptr= %p, red_stack= %p\n", stack_len, curr, rs_top_ptr, red_stack));
@@ -925,6 +5655,10 @@ again:
 	    }
 	    continue;
 	}
+#ifndef TINY_VERSION
+	if (rs_top_ptr == stack_end)
+	    engine_error("out of stack space");
+#endif
 	--rs_top_ptr;
 	*rs_top_ptr = curr;
 	++stack_len;
@@ -942,6 +5676,14 @@ again:
 	uint8_t subtype;
 	debug_printf(("# ARGMATCH: stack_len= %u, reqargs= %u\n", stack_len, (short) reqargs));
 	++reductions;
+#ifdef USE_POSIX
+	if (reductions >= fork_check_at)
+	    fork_worker();
+#endif
+#ifdef MULTIPLE_ENGINES
+	if (reductions >= ENGINE.check_at)
+	    check_reductions();
+#endif
 	subtype = LIT_SUBTYPE(ATOM_TO_LIT(curr));
 	curr = rs_top_ptr[reqargs-1];
 	curr = (reducers[subtype])(curr);
@@ -962,3 +5704,215 @@ not_reduced:
 }
 
 
+
+#ifdef MINISK_LIBRARY
+/*
+ * The library API (see mini-sk.h).
+ *
+ * Each call makes the given engine the one in use for its duration.  If
+ * the engine runs out of anything part way through, engine_error jumps
+ * back here, where the engine is reset, since its heap may be half way
+ * through being rewritten.  Bumping the generation tells the host that
+ * the terms it held are gone.
+ */
+
+void reset_engine(void)
+{
+    int (*io_get)(void* io) = ENGINE.io_get;
+    int (*io_put)(int c, void* io) = ENGINE.io_put;
+    void* io_context = ENGINE.io_context;
+    const char* error = ENGINE.error;
+    unsigned int generation = ENGINE.generation;
+    free_all_mem();
+    init_engine();
+    ENGINE.io_get = io_get;
+    ENGINE.io_put = io_put;
+    ENGINE.io_context = io_context;
+    ENGINE.error = error;
+    ENGINE.generation = generation + 1;
+}
+
+#define ENTER_ENGINE(e, failed)			\
+    jmp_buf on_error;				\
+    struct engine* saved_engine = engine;	\
+    engine = (e);				\
+    ENGINE.on_error = &on_error;		\
+    if (setjmp(on_error)) {			\
+	reset_engine();				\
+	engine = saved_engine;			\
+	return failed;				\
+    }
+
+#define LEAVE_ENGINE				\
+    ENGINE.on_error = NULL;			\
+    engine = saved_engine
+
+minisk_engine* minisk_new(void)
+{
+    struct engine* saved_engine = engine;
+    struct engine* e = new_engine();
+    if (e != NULL) {
+	e->error = NULL;
+	e->generation = 0;
+    }
+    engine = saved_engine;
+    return e;
+}
+
+void minisk_delete(minisk_engine* e)
+{
+    free_engine(e);
+}
+
+void minisk_reset(minisk_engine* e)
+{
+    struct engine* saved_engine = engine;
+    engine = e;
+    ENGINE.error = NULL;
+    reset_engine();
+    engine = saved_engine;
+}
+
+unsigned int minisk_generation(minisk_engine* e)
+{
+    return e->generation;
+}
+
+const char* minisk_error(minisk_engine* e)
+{
+    return e->error;
+}
+
+void minisk_set_io(minisk_engine* e, int (*get)(void* io),
+		   int (*put)(int c, void* io), void* io)
+{
+    e->io_get = get != NULL ? get : std_get;
+    e->io_put = put != NULL ? put : std_put;
+    e->io_context = io;
+}
+
+minisk_term minisk_parse(minisk_engine* e, const char* text)
+{
+    atom a;
+    ENTER_ENGINE(e, MINISK_NONE)
+    ENGINE.error = NULL;
+    a = string_to_atom(text);
+    if (ENGINE.error != NULL) {
+	free_app_all(a);
+	a = MINISK_NONE;
+    }
+    LEAVE_ENGINE;
+    return a;
+}
+
+/* A failure can be passed on, as MINISK_NONE, to minisk_apply and reduce. */
+minisk_term minisk_apply(minisk_engine* e, minisk_term f, minisk_term x)
+{
+    atom a;
+    ENTER_ENGINE(e, MINISK_NONE)
+    if (f == MINISK_NONE || x == MINISK_NONE) {
+	free_app_all(f == MINISK_NONE ? x : f);
+	a = MINISK_NONE;
+    } else {
+	a = alloc_app(f, x);
+    }
+    LEAVE_ENGINE;
+    return a;
+}
+
+minisk_term minisk_copy(minisk_engine* e, minisk_term t)
+{
+    struct engine* saved_engine = engine;
+    engine = e;
+    copy_atom(t);
+    engine = saved_engine;
+    return t;
+}
+
+void minisk_release(minisk_engine* e, minisk_term t)
+{
+    struct engine* saved_engine = engine;
+    if (t == MINISK_NONE)
+	return;
+    engine = e;
+    free_app_all(t);
+    engine = saved_engine;
+}
+
+minisk_term minisk_reduce(minisk_engine* e, minisk_term t, int deep,
+			  const struct minisk_limits* limits)
+{
+    atom a = t;
+    ENTER_ENGINE(e, MINISK_NONE)
+    if (a != MINISK_NONE) {
+	ENGINE.error = NULL;
+	reductions = 0;
+	max_apps = current_apps;
+	if (limits != NULL)
+	    set_limits(limits->max_reductions,
+		       limits->max_nodes < MAX_APPS
+		       ? (uint16_t) limits->max_nodes : MAX_APPS,
+		       limits->max_bytes, limits->max_millis);
+	if (deep)
+	    deep_reduce(&a);
+	else
+	    a = reduce(a);
+	clear_limits();
+    }
+    LEAVE_ENGINE;
+    return a;
+}
+
+unsigned int minisk_reductions(minisk_engine* e)
+{
+    struct engine* saved_engine = engine;
+    unsigned int n;
+    engine = e;
+    n = reductions;
+    engine = saved_engine;
+    return n;
+}
+
+unsigned int minisk_max_nodes(minisk_engine* e)
+{
+    struct engine* saved_engine = engine;
+    unsigned int n;
+    engine = e;
+    n = max_apps;
+    engine = saved_engine;
+    return n;
+}
+
+size_t minisk_print(minisk_engine* e, minisk_term t, char* buf, size_t size)
+{
+    struct out_buf ob;
+    ENTER_ENGINE(e, 0)
+    ob.buf = buf;
+    ob.size = size;
+    ob.len = 0;
+    output_context = &ob;
+    putch = sputch;
+    print_atom(t);
+    output_context = (void*) stdout;
+    putch = fputch;
+    if (size > 0)
+	buf[ob.len < size ? ob.len : size - 1] = '\0';
+    LEAVE_ENGINE;
+    return ob.len;
+}
+
+minisk_term minisk_literal(unsigned int value)
+{
+    return LIT_TO_ATOM(value & 0x7fff);
+}
+
+int minisk_is_literal(minisk_term t)
+{
+    return IS_LIT(t);
+}
+
+unsigned int minisk_literal_value(minisk_term t)
+{
+    return ATOM_TO_LIT(t);
+}
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Mini-SK as a library.
+ *
+ * Copyright 2020, Melissa O'Neill.  Distributed under the MIT License.
+ *
+ * Build mini-sk.c with -DMINISK_LIBRARY to get these functions in place of
+ * the REPL.  Each engine has its own heap, and a term is only meaningful
+ * to the engine that made it.  Terms are reference counted: functions that
+ * take terms consume a reference to each (use minisk_copy to keep one),
+ * and functions that return terms hand back a new one, which the caller
+ * must eventually release.
+ *
+ * If an engine runs out of space (or hits a limit) the call fails,
+ * returning MINISK_NONE, minisk_error says why, and the engine is reset.
+ * Resetting frees every term the engine had, which minisk_generation
+ * shows by changing.  Parsing can also fail because the text doesn't
+ * make sense, which doesn't reset the engine.
+ *
+ * An engine can only be used by one thread at a time, and unless
+ * mini-sk.c is built with -DENGINE_LOCAL=__thread (or _Thread_local),
+ * only one thread can use the library at a time.
+ */
+
+#ifndef MINI_SK_H
+#define MINI_SK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct engine minisk_engine;
+typedef unsigned short minisk_term;
+
+#define MINISK_NONE ((minisk_term) 0xffff)
+
+/* Limits for minisk_reduce, with 0 for no limit. */
+struct minisk_limits {
+    unsigned int max_reductions;
+    unsigned int max_nodes;	/* beyond those in use beforehand */
+    size_t max_bytes;		/* for strings, arrays and maps */
+    unsigned long max_millis;	/* of wall-clock time */
+};
+
+/* Engines; minisk_new returns NULL if there's no memory. */
+minisk_engine* minisk_new(void);
+void minisk_delete(minisk_engine* e);
+void minisk_reset(minisk_engine* e);
+unsigned int minisk_generation(minisk_engine* e);
+const char* minisk_error(minisk_engine* e);
+
+/*
+ * What the G and P combinators read and write, by default stdin and
+ * stdout.  get returns a character, or -1 at the end of the input.
+ */
+void minisk_set_io(minisk_engine* e, int (*get)(void* io),
+		   int (*put)(int c, void* io), void* io);
+
+/* Terms */
+minisk_term minisk_parse(minisk_engine* e, const char* text);
+minisk_term minisk_apply(minisk_engine* e, minisk_term f, minisk_term x);
+minisk_term minisk_copy(minisk_engine* e, minisk_term t);
+void minisk_release(minisk_engine* e, minisk_term t);
+
+/*
+ * Reduces t to weak head normal form, or with deep set, reduces
+ * everything inside it too (like $deepseq).  limits may be NULL.
+ */
+minisk_term minisk_reduce(minisk_engine* e, minisk_term t, int deep,
+			  const struct minisk_limits* limits);
+unsigned int minisk_reductions(minisk_engine* e);
+unsigned int minisk_max_nodes(minisk_engine* e);
+
+/*
+ * Prints t as the REPL would, like snprintf: the result is the length of
+ * the whole text, of which as much as fits is put in buf.
+ */
+size_t minisk_print(minisk_engine* e, minisk_term t, char* buf, size_t size);
+
+/* Literals, i.e., combinators, characters and 15-bit numbers. */
+minisk_term minisk_literal(unsigned int value);
+int minisk_is_literal(minisk_term t);
+unsigned int minisk_literal_value(minisk_term t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Mini-SK as a library, for C++ (C++11 or later).
+ *
+ * Copyright 2020, Melissa O'Neill.  Distributed under the MIT License.
+ *
+ * A thin layer over mini-sk.h.  A minisk::term owns one reference to a
+ * term, so copying one costs a minisk_copy and destroying one a
+ * minisk_release, but moving one costs nothing; pass terms you're done
+ * with using std::move.  Failures throw minisk::error.  If a failure
+ * reset the engine, terms made before it quietly become empty, rather
+ * than releasing nodes that now belong to someone else.
+ */
+
+#ifndef MINI_SK_HPP
+#define MINI_SK_HPP
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "mini-sk.h"
+
+namespace minisk {
+
+class error : public std::runtime_error {
+public:
+    explicit error(const char* what)
+        : std::runtime_error(what != nullptr ? what : "mini-sk error")
+    {
+    }
+};
+
+class engine;
+
+class term {
+public:
+    term() noexcept = default;
+
+    term(const term& other)
+        : engine_(other.engine_), term_(other.term_),
+          generation_(other.generation_)
+    {
+        if (owns())
+            minisk_copy(engine_, term_);
+        else
+            engine_ = nullptr;
+    }
+
+    term(term&& other) noexcept
+        : engine_(other.engine_), term_(other.term_),
+          generation_(other.generation_)
+    {
+        other.engine_ = nullptr;
+    }
+
+    term& operator=(term other) noexcept
+    {
+        swap(other);
+        return *this;
+    }
+
+    ~term()
+    {
+        if (owns())
+            minisk_release(engine_, term_);
+    }
+
+    void swap(term& other) noexcept
+    {
+        std::swap(engine_, other.engine_);
+        std::swap(term_, other.term_);
+        std::swap(generation_, other.generation_);
+    }
+
+    /* False if empty, or if the engine has been reset since. */
+    bool valid() const noexcept
+    {
+        return is_literal() || owns();
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return valid();
+    }
+
+    minisk_term get() const noexcept
+    {
+        return term_;
+    }
+
+    /* Gives up ownership, for passing to the C API. */
+    minisk_term release() noexcept
+    {
+        engine_ = nullptr;
+        return term_;
+    }
+
+    bool is_literal() const noexcept
+    {
+        return minisk_is_literal(term_) != 0;
+    }
+
+    unsigned int literal_value() const noexcept
+    {
+        return minisk_literal_value(term_);
+    }
+
+private:
+    friend class engine;
+
+    bool owns() const noexcept
+    {
+        return engine_ != nullptr
+            && minisk_generation(engine_) == generation_;
+    }
+
+    /* Takes ownership of t, a result from e. */
+    term(minisk_engine* e, minisk_term t)
+        : engine_(e), term_(t), generation_(minisk_generation(e))
+    {
+    }
+
+    minisk_engine* engine_ = nullptr;
+    minisk_term term_ = MINISK_NONE;
+    unsigned int generation_ = 0;
+};
+
+class engine {
+public:
+    engine()
+        : engine_(minisk_new())
+    {
+        if (engine_ == nullptr)
+            throw error("out of memory");
+    }
+
+    engine(const engine&) = delete;
+    engine& operator=(const engine&) = delete;
+
+    /* Terms must not outlive their engine. */
+    ~engine()
+    {
+        minisk_delete(engine_);
+    }
+
+    void reset()
+    {
+        minisk_reset(engine_);
+    }
+
+    void set_io(int (*get)(void* io), int (*put)(int c, void* io),
+                void* io)
+    {
+        minisk_set_io(engine_, get, put, io);
+    }
+
+    term parse(const char* text)
+    {
+        return check(minisk_parse(engine_, text));
+    }
+
+    term parse(const std::string& text)
+    {
+        return parse(text.c_str());
+    }
+
+    static term literal(unsigned int value)
+    {
+        term t;
+        t.term_ = minisk_literal(value);
+        return t;
+    }
+
+    term apply(term f, term x)
+    {
+        use(f);
+        use(x);
+        return check(minisk_apply(engine_, f.release(), x.release()));
+    }
+
+    term reduce(term t, unsigned int max_reductions = 0, bool deep = false)
+    {
+        minisk_limits limits = minisk_limits();
+        limits.max_reductions = max_reductions;
+        return reduce(std::move(t), limits, deep);
+    }
+
+    term reduce(term t, const minisk_limits& limits, bool deep = false)
+    {
+        return check(minisk_reduce(engine_, take(t), deep, &limits));
+    }
+
+    std::string print(const term& t)
+    {
+        char buf[256];
+        size_t len = minisk_print(engine_, use(t), buf, sizeof(buf));
+        if (len < sizeof(buf))
+            return std::string(buf, len);
+        std::string text(len + 1, '\0');
+        minisk_print(engine_, t.get(), &text[0], text.size());
+        text.resize(len);
+        return text;
+    }
+
+    unsigned int reductions() const
+    {
+        return minisk_reductions(engine_);
+    }
+
+    unsigned int max_nodes() const
+    {
+        return minisk_max_nodes(engine_);
+    }
+
+    minisk_engine* get() const noexcept
+    {
+        return engine_;
+    }
+
+private:
+    term check(minisk_term t)
+    {
+        if (t == MINISK_NONE)
+            throw error(minisk_error(engine_));
+        return term(engine_, t);
+    }
+
+    /* Literals (which need no reference) can be used with any engine. */
+    minisk_term use(const term& t) const
+    {
+        if (!t.is_literal() && (!t.owns() || t.engine_ != engine_))
+            throw error("term is not from this engine");
+        return t.get();
+    }
+
+    /* Hands over t's reference. */
+    minisk_term take(term& t)
+    {
+        use(t);
+        return t.release();
+    }
+
+    minisk_engine* engine_;
+};
+
+} // namespace minisk
+
+#endif